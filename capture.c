@@ -0,0 +1,757 @@
+/*
+ * capture.c - record the allocations of a running program as a trace
+ *
+ * Built as libcapture.so, this is an interposer for LD_PRELOAD: every
+ * malloc, calloc, realloc, free, memalign, posix_memalign and
+ * aligned_alloc is passed on to the next malloc, the system's or
+ * libmm.so's, and recorded as an event in a ring buffer of the calling
+ * thread:
+ *
+ *     MMCAPTURE=svc.%p.raw LD_PRELOAD=./libcapture.so ./server
+ *     LD_PRELOAD="./libcapture.so ./libmm.so" ./server
+ *
+ * A thread only writes the head of its own ring and a flusher thread
+ * only the tail, so recording takes no lock: one atomic add of a global
+ * sequence number, which orders the events of all threads, and a store
+ * into the ring. The flusher writes the rings to the raw file in the
+ * background. A thread waits only when the flusher is a whole ring
+ * behind, and the ring of an exited thread is given to the next new one.
+ *
+ * Built with -DCAPTURE_TOOL, this is the capture program, which turns
+ * the raw file into a text trace for mdriver:
+ *
+ *     ./capture svc.raw svc.rep
+ *
+ * It sorts the events by sequence number and gives the blocks the dense
+ * ids, in order of allocation, that read_trace expects, and writes the
+ * num_ids and num_ops of the header at the end.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* An event of the raw file, 32 bytes */
+typedef struct {
+    uint64_t seq;               /* op in the top byte, sequence number below */
+    uint64_t ptr;               /* the block, the new one of a realloc */
+    uint64_t old;               /* the old block of a realloc */
+    uint64_t size;
+} event_t;
+
+/*
+ * A realloc is two events: CAP_RELEASE of the old block before the call,
+ * and CAP_REALLOC with the new block after it, or with the old block and
+ * size 0 if it failed
+ */
+enum { CAP_ALLOC = 1, CAP_FREE, CAP_RELEASE, CAP_REALLOC };
+#define SEQ_BITS 56
+#define SEQ_MASK ((1ULL << SEQ_BITS) - 1)
+#define EVENT_OP(e) ((int)((e)->seq >> SEQ_BITS))
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+#ifndef CAPTURE_TOOL
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+/* Events in the ring of a thread, a power of 2 (2MB) */
+#ifndef RING_EVENTS
+#define RING_EVENTS (1 << 16)
+#endif
+
+/* The flusher sleeps this long when there is nothing to write */
+#define FLUSH_NS 10000000
+
+/* Bytes for the allocations of dlsym, before the next malloc is known */
+#define BOOT_SIZE 4096
+
+enum { RING_LIVE, RING_DEAD, RING_FREE };
+
+/* the head and the tail are on lines of their own */
+typedef struct ring {
+    unsigned long head;         /* written by the thread */
+    char pad1[64 - sizeof(unsigned long)];
+    unsigned long tail;         /* written by the flusher */
+    char pad2[64 - sizeof(unsigned long)];
+    int state;
+    struct ring *next;          /* all the rings, never removed */
+    event_t ev[RING_EVENTS];
+} ring_t;
+
+/* the malloc that is interposed */
+static void *(*next_malloc)(size_t);
+static void *(*next_calloc)(size_t, size_t);
+static void *(*next_realloc)(void *, size_t);
+static void (*next_free)(void *);
+static void *(*next_memalign)(size_t, size_t);
+static int (*next_posix_memalign)(void **, size_t, size_t);
+static void *(*next_aligned_alloc)(size_t, size_t);
+
+static char boot_buf[BOOT_SIZE] __attribute__((aligned(16)));
+static size_t boot_used;
+static int resolving;
+
+static ring_t *rings;
+static uint64_t next_seq;
+static int enabled;             /* set once the flusher runs */
+static int stopping;
+static int fd = -1;
+static pthread_t flusher;
+static pthread_key_t ring_key;
+static unsigned long stalls;    /* times a thread waited for the flusher */
+static __thread ring_t *my_ring;
+static __thread int in_capture; /* the calls of this thread are not recorded */
+
+static void resolve(void);
+static ring_t *attach(void);
+static void detach(void *arg);
+static void record(int op, void *ptr, void *old, size_t size);
+static int drain(ring_t *r);
+static void *flush_loop(void *arg);
+static void write_all(const void *buf, size_t len);
+static void capture_init(void) __attribute__((constructor));
+static void capture_fini(void) __attribute__((destructor));
+static void capture_child(void);
+
+/*
+ * resolve - find the next malloc. dlsym may call calloc itself, which
+ *      is given the bytes of boot_buf meanwhile
+ */
+static void resolve(void)
+{
+    if (next_malloc != NULL || resolving)
+        return;
+    resolving = 1;
+    next_malloc = dlsym(RTLD_NEXT, "malloc");
+    next_calloc = dlsym(RTLD_NEXT, "calloc");
+    next_realloc = dlsym(RTLD_NEXT, "realloc");
+    next_free = dlsym(RTLD_NEXT, "free");
+    next_memalign = dlsym(RTLD_NEXT, "memalign");
+    next_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    next_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    resolving = 0;
+}
+
+/*
+ * boot_alloc - allocate from boot_buf, which is never freed
+ */
+static void *boot_alloc(size_t size)
+{
+    size_t start = (boot_used + 15) & ~(size_t)15;
+
+    if (size > BOOT_SIZE - start)
+        return NULL;
+    boot_used = start + size;
+    return boot_buf + start;
+}
+
+static int is_boot(const void *p)
+{
+    return (const char *)p >= boot_buf && (const char *)p < boot_buf + BOOT_SIZE;
+}
+
+/*
+ * attach - give the calling thread a ring, the one of an exited thread
+ *      if the flusher has written it all, or else a new mapping
+ */
+static ring_t *attach(void)
+{
+    ring_t *r;
+    int state;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        state = RING_FREE;
+        if (__atomic_compare_exchange_n(&r->state, &state, RING_LIVE, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (r == NULL) {
+        r = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED)
+            return NULL;
+        r->state = RING_LIVE;
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    my_ring = r;
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+/*
+ * detach - the destructor of ring_key: the ring is given back once the
+ *      flusher has written the rest of it
+ */
+static void detach(void *arg)
+{
+    ring_t *r = arg;
+
+    my_ring = NULL;
+    __atomic_store_n(&r->state, RING_DEAD, __ATOMIC_RELEASE);
+}
+
+/*
+ * record - append an event to the ring of the calling thread. An
+ *      allocation is recorded after the call and a free before it, so
+ *      that a block freed by one thread and got by another is in order;
+ *      a realloc does both
+ */
+static void record(int op, void *ptr, void *old, size_t size)
+{
+    ring_t *r = my_ring;
+    unsigned long head;
+    event_t *e;
+
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED) || in_capture)
+        return;
+    in_capture = 1;
+    if (r == NULL && (r = attach()) == NULL) {
+        in_capture = 0;
+        return;
+    }
+    head = r->head;
+    while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING_EVENTS) {
+        if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+            in_capture = 0;
+            return;
+        }
+        __atomic_add_fetch(&stalls, 1, __ATOMIC_RELAXED);
+        sched_yield();
+    }
+    e = &r->ev[head & (RING_EVENTS - 1)];
+    e->seq = (__atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED) & SEQ_MASK) |
+             ((uint64_t)op << SEQ_BITS);
+    e->ptr = (uintptr_t)ptr;
+    e->old = (uintptr_t)old;
+    e->size = size;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    in_capture = 0;
+}
+
+/*
+ * write_all - write len bytes to the raw file, giving up on an error
+ */
+static void write_all(const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0 && fd >= 0) {
+        if ((n = write(fd, p, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            fd = -1;
+            return;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/*
+ * drain - write the events of ring r up to its head, and give the ring
+ *      back if its thread has exited. Return the number of events
+ */
+static int drain(ring_t *r)
+{
+    int dead = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE) == RING_DEAD;
+    unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = r->tail;
+    unsigned long lo = tail & (RING_EVENTS - 1);
+    unsigned long n = head - tail;
+
+    if (n > 0) {
+        if (lo + n > RING_EVENTS) {
+            write_all(&r->ev[lo], (RING_EVENTS - lo) * sizeof(event_t));
+            write_all(&r->ev[0], (lo + n - RING_EVENTS) * sizeof(event_t));
+        } else {
+            write_all(&r->ev[lo], n * sizeof(event_t));
+        }
+        __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+    }
+    /* a dead ring gets no more events once it's seen dead */
+    if (dead)
+        __atomic_store_n(&r->state, RING_FREE, __ATOMIC_RELEASE);
+    return (int)n;
+}
+
+/*
+ * flush_loop - the flusher thread, until capture_fini stops it
+ */
+static void *flush_loop(void *arg)
+{
+    struct timespec nap = {0, FLUSH_NS};
+    ring_t *r;
+    int n, stop;
+
+    in_capture = 1;
+    do {
+        stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        n = 0;
+        for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+            n += drain(r);
+        if (n == 0 && !stop)
+            nanosleep(&nap, NULL);
+    } while (!stop);
+    return NULL;
+}
+
+/*
+ * capture_init - open the raw file, $MMCAPTURE or mmcapture.%p.raw with
+ *      %p for the pid, so that the programs a program runs each have
+ *      one, and start the flusher. Nothing is recorded before, which in
+ *      a program is only what the constructors of other libraries do
+ */
+static void capture_init(void)
+{
+    char path[PATH_MAX];
+    const char *name = getenv("MMCAPTURE"), *p;
+    size_t n = 0;
+
+    resolve();
+    if (name == NULL || *name == '\0')
+        name = "mmcapture.%p.raw";
+    for (p = name; *p != '\0' && n < sizeof(path) - 16; p++) {
+        if (p[0] == '%' && p[1] == 'p') {
+            n += snprintf(path + n, sizeof(path) - n, "%d", (int)getpid());
+            p++;
+        } else {
+            path[n++] = *p;
+        }
+    }
+    path[n] = '\0';
+    in_capture = 1;
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+        pthread_key_create(&ring_key, detach) != 0) {
+        in_capture = 0;
+        return;
+    }
+    pthread_atfork(NULL, NULL, capture_child);
+    if (pthread_create(&flusher, NULL, flush_loop, NULL) == 0)
+        __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    in_capture = 0;
+}
+
+/*
+ * capture_fini - stop recording, and wait for the flusher to write the
+ *      rest of the rings
+ */
+static void capture_fini(void)
+{
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE))
+        return;
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+    if (stalls > 0) {
+        char msg[80];
+        int len = snprintf(msg, sizeof(msg), "capture: threads waited for the flusher %lu times\n",
+                           stalls);
+        write(STDERR_FILENO, msg, len);
+    }
+    close(fd);
+    fd = -1;
+}
+
+/*
+ * capture_child - a child of fork has no flusher, and records nothing
+ */
+static void capture_child(void)
+{
+    enabled = 0;
+    fd = -1;
+}
+
+void *malloc(size_t size)
+{
+    void *p;
+
+    if (next_malloc == NULL) {
+        resolve();
+        if (next_malloc == NULL)
+            return boot_alloc(size);
+    }
+    if ((p = next_malloc(size)) != NULL)
+        record(CAP_ALLOC, p, NULL, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (next_calloc == NULL)
+        resolve();
+    if (next_calloc == NULL) {
+        if (size && nmemb > SIZE_MAX / size)
+            return NULL;
+        return boot_alloc(nmemb * size);
+    }
+    if ((p = next_calloc(nmemb, size)) != NULL)
+        record(CAP_ALLOC, p, NULL, nmemb * size);
+    return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (next_realloc == NULL)
+        resolve();
+    if (ptr == NULL)
+        return malloc(size);
+    if (is_boot(ptr)) {
+        /* the old size isn't known, but it's within boot_buf */
+        if ((p = malloc(size)) != NULL)
+            memcpy(p, ptr, MIN((size_t)(boot_buf + BOOT_SIZE - (char *)ptr), size));
+        return p;
+    }
+    if (size == 0) {
+        record(CAP_FREE, ptr, NULL, 0);
+        return next_realloc(ptr, 0);
+    }
+    record(CAP_RELEASE, ptr, NULL, 0);
+    p = next_realloc(ptr, size);
+    record(CAP_REALLOC, p != NULL ? p : ptr, ptr, p != NULL ? size : 0);
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || is_boot(ptr))
+        return;
+    if (next_free == NULL)
+        resolve();
+    record(CAP_FREE, ptr, NULL, 0);
+    next_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *p;
+
+    if (next_memalign == NULL)
+        resolve();
+    if ((p = next_memalign(alignment, size)) != NULL)
+        record(CAP_ALLOC, p, NULL, size);
+    return p;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    int err;
+
+    if (next_posix_memalign == NULL)
+        resolve();
+    if ((err = next_posix_memalign(memptr, alignment, size)) == 0)
+        record(CAP_ALLOC, *memptr, NULL, size);
+    return err;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    void *p;
+
+    if (next_aligned_alloc == NULL)
+        resolve();
+    if ((p = next_aligned_alloc(alignment, size)) != NULL)
+        record(CAP_ALLOC, p, NULL, size);
+    return p;
+}
+
+#else /* CAPTURE_TOOL */
+
+/* an open-addressed table of blocks, address to id */
+typedef struct {
+    uint64_t addr;              /* 0 if the slot is empty */
+    int id;
+    size_t size;
+} slot_t;
+
+typedef struct {
+    slot_t *slots;
+    size_t size;                /* a power of 2 */
+    size_t used;
+} map_t;
+
+static map_t live;              /* the blocks allocated */
+static map_t moving;            /* the blocks in a realloc, by old address */
+static int ids;
+static long long nops, unknown, reused, live_bytes, peak_bytes;
+static FILE *out;
+
+static void usage(void);
+static void app_error(const char *fmt, ...);
+static int cmp_event(const void *a, const void *b);
+static slot_t *lookup(map_t *m, uint64_t addr);
+static void insert(map_t *m, uint64_t addr, int id, size_t size);
+static void delete(map_t *m, slot_t *s);
+static void place(uint64_t addr, int id, size_t size);
+static void convert(const event_t *e);
+
+int main(int argc, char **argv)
+{
+    int c, fd, weight = 1;
+    struct stat st;
+    event_t *ev;
+    size_t n, i;
+
+    while ((c = getopt(argc, argv, "w:h")) != EOF) {
+        switch (c) {
+        case 'w': /* Weight of the trace */
+            weight = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind != argc - 2) {
+        usage();
+        exit(1);
+    }
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+        app_error("can't open %s: %s", argv[optind], strerror(errno));
+    n = st.st_size / sizeof(event_t);
+    if (n == 0)
+        app_error("%s has no events", argv[optind]);
+    ev = mmap(NULL, n * sizeof(event_t), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (ev == MAP_FAILED)
+        app_error("can't map %s: %s", argv[optind], strerror(errno));
+    close(fd);
+    if ((out = fopen(argv[optind + 1], "w")) == NULL)
+        app_error("can't open %s: %s", argv[optind + 1], strerror(errno));
+
+    /* the rings are written in turn, so the events are only in order per thread */
+    qsort(ev, n, sizeof(event_t), cmp_event);
+
+    /* the header is written again at the end, with the counts */
+    fprintf(out, "%d\n%11d\n%11d\n0\n", weight, 0, 0);
+    for (i = 0; i < n; i++)
+        convert(&ev[i]);
+    if (ids == 0)
+        app_error("%s has no allocations", argv[optind]);
+    rewind(out);
+    fprintf(out, "%d\n%11d\n%11d\n0\n", weight, ids, (int)nops);
+    if (fclose(out) != 0)
+        app_error("can't write %s: %s", argv[optind + 1], strerror(errno));
+
+    printf("%s: %lld requests, %d blocks, %zu still live, peak %lld bytes live\n",
+           argv[optind + 1], nops, ids, live.used, peak_bytes);
+    if (unknown > 0 || reused > 0)
+        printf("%lld frees of blocks not captured skipped, %lld addresses reused while live\n",
+               unknown, reused);
+    return 0;
+}
+
+/*
+ * place - make addr the address of block id. A block that is still at
+ *      addr was freed in a way not captured, e.g. by a function of libc
+ *      that calls its own free, and is freed first
+ */
+static void place(uint64_t addr, int id, size_t size)
+{
+    slot_t *s = lookup(&live, addr);
+
+    if (s->addr != 0) {
+        fprintf(out, "f %d\n", s->id);
+        live_bytes -= s->size;
+        delete(&live, s);
+        ++reused;
+        ++nops;
+    }
+    insert(&live, addr, id, size);
+    live_bytes += size;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+}
+
+/*
+ * convert - write the request of event e, if any
+ */
+static void convert(const event_t *e)
+{
+    size_t size = e->size < 1 ? 1 : e->size > INT_MAX ? INT_MAX : e->size;
+    slot_t *s;
+    int id;
+
+    if (ids == INT_MAX || nops >= INT_MAX - 1)
+        app_error("more blocks or requests than a trace can hold");
+    switch (EVENT_OP(e)) {
+    case CAP_ALLOC:
+        fprintf(out, "a %d %zu\n", ids, size);
+        place(e->ptr, ids++, size);
+        ++nops;
+        break;
+    case CAP_FREE:
+        if ((s = lookup(&live, e->ptr))->addr == 0) {
+            /* a block from before the capture, or from an allocator not seen */
+            ++unknown;
+            break;
+        }
+        fprintf(out, "f %d\n", s->id);
+        live_bytes -= s->size;
+        delete(&live, s);
+        ++nops;
+        break;
+    case CAP_RELEASE:
+        /* the old address may be given to another thread until the realloc ends */
+        if ((s = lookup(&live, e->ptr))->addr != 0 && lookup(&moving, e->ptr)->addr == 0) {
+            live_bytes -= s->size;
+            insert(&moving, s->addr, s->id, s->size);
+            delete(&live, s);
+        }
+        break;
+    case CAP_REALLOC:
+        if ((s = lookup(&moving, e->old))->addr == 0) {
+            /* of a block not captured, so it's a new one */
+            if (e->size == 0)
+                break;
+            ++unknown;
+            fprintf(out, "a %d %zu\n", ids, size);
+            place(e->ptr, ids++, size);
+            ++nops;
+            break;
+        }
+        id = s->id;
+        if (e->size == 0) {
+            /* it failed, and the old block stays */
+            size = s->size;
+            delete(&moving, s);
+            place(e->old, id, size);
+            break;
+        }
+        delete(&moving, s);
+        fprintf(out, "r %d %zu\n", id, size);
+        place(e->ptr, id, size);
+        ++nops;
+        break;
+    default:
+        app_error("bad event %llu", (unsigned long long)e->seq);
+    }
+}
+
+/*
+ * cmp_event - order events by sequence number
+ */
+static int cmp_event(const void *a, const void *b)
+{
+    uint64_t x = ((const event_t *)a)->seq & SEQ_MASK;
+    uint64_t y = ((const event_t *)b)->seq & SEQ_MASK;
+
+    return (x > y) - (x < y);
+}
+
+static size_t hash(uint64_t addr)
+{
+    return (size_t)((addr >> 4) * 0x9e3779b97f4a7c15ULL);
+}
+
+/*
+ * lookup - return the slot of addr in m, or the empty slot where it would go
+ */
+static slot_t *lookup(map_t *m, uint64_t addr)
+{
+    size_t i;
+
+    if (m->slots == NULL) {
+        m->size = 1024;
+        if ((m->slots = calloc(m->size, sizeof(slot_t))) == NULL)
+            app_error("out of memory");
+    }
+    i = hash(addr) & (m->size - 1);
+    while (m->slots[i].addr != 0 && m->slots[i].addr != addr)
+        i = (i + 1) & (m->size - 1);
+    return &m->slots[i];
+}
+
+/*
+ * insert - add addr, which isn't in m. A map is kept at most half full
+ */
+static void insert(map_t *m, uint64_t addr, int id, size_t size)
+{
+    slot_t *s;
+
+    if (m->slots == NULL || 2 * (m->used + 1) > m->size) {
+        slot_t *old = m->slots;
+        size_t old_size = old != NULL ? m->size : 0, i;
+
+        m->size = old != NULL ? 2 * m->size : 1024;
+        if ((m->slots = calloc(m->size, sizeof(slot_t))) == NULL)
+            app_error("out of memory");
+        for (i = 0; i < old_size; i++)
+            if (old[i].addr != 0)
+                *lookup(m, old[i].addr) = old[i];
+        free(old);
+    }
+    s = lookup(m, addr);
+    s->addr = addr;
+    s->id = id;
+    s->size = size;
+    ++m->used;
+}
+
+/*
+ * delete - empty slot s of m, moving back the slots after it that would
+ *      no longer be found
+ */
+static void delete(map_t *m, slot_t *s)
+{
+    size_t mask = m->size - 1, i = s - m->slots, j = i, k;
+
+    for (;;) {
+        j = (j + 1) & mask;
+        if (m->slots[j].addr == 0)
+            break;
+        k = hash(m->slots[j].addr) & mask;
+        /* move j to i unless its home k lies cyclically in (i, j] */
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        m->slots[i] = m->slots[j];
+        i = j;
+    }
+    m->slots[i].addr = 0;
+    --m->used;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: capture [-h] [-w <weight>] <raw> <trace>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-w <weight> Weight of the trace (default 1).\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "<raw> is written by a program run with LD_PRELOAD=./libcapture.so,\n"
+                    "to $MMCAPTURE or mmcapture.%%p.raw, where %%p is the pid.\n");
+}
+
+static void app_error(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "capture: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+#endif /* CAPTURE_TOOL */
@@ -104,9 +104,11 @@
 #define ALIGNMENT 8
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes, e.g. -DMAX_HEAP="(8UL<<30)" with MM_WIDE
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -0,0 +1,425 @@
+/*
+ * gentrace.c - write a synthetic trace for mdriver
+ *
+ * The trace is drawn from a parametric workload: a distribution of the
+ * request sizes, a distribution of how many requests a block lives, a
+ * chance that a request grows a live block with realloc, and a target
+ * for the bytes alive at once. A distribution is a list of terms
+ * separated by commas, each with an optional weight:
+ *
+ *     fixed:N                  always N
+ *     uniform:LO:HI            uniform in [LO, HI]
+ *     pow:ALPHA:LO:HI          power law in [LO, HI], P(x) ~ x^-(ALPHA+1)
+ *     exp:MEAN                 exponential
+ *     lognormal:MU:SIGMA       e^N(MU, SIGMA)
+ *
+ * e.g. "0.9*exp:100,0.1*uniform:100000:1000000" for lifetimes of
+ * short-lived request buffers mixed with a long-lived cache.
+ *
+ * The ops are written as they are drawn, so a trace of tens of millions
+ * of ops takes memory only for the live blocks. The output is a text
+ * trace, or with -b a binary trace that mdriver maps as it is.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAXTERMS 16              /* terms of one distribution */
+
+/*
+ * a binary trace, the same layout as binheader_t and traceop_t in mdriver.c,
+ * whose enum goes on with the batch ops that are never written here. The
+ * magic must follow BIN_MAGIC there
+ */
+#define BIN_MAGIC "MMTRACE2"
+
+typedef struct {
+    enum { ALLOC, FREE, REALLOC } type;
+    int index;
+    size_t size;
+} traceop_t;
+
+typedef struct {
+    char magic[8];
+    int weight;
+    int num_ids;
+    int num_ops;
+    int ignore_ranges;
+    int op_size;
+    int pad;
+} binheader_t;
+
+/* A distribution, a mixture of terms */
+typedef struct {
+    int n;
+    struct {
+        enum { FIXED, UNIFORM, POW, EXP, LOGNORMAL } kind;
+        double w;                /* cumulative weight, the last is 1 */
+        double a, b, c;          /* parameters of the kind */
+    } terms[MAXTERMS];
+} dist_t;
+
+/* A live block, in a min-heap ordered by the request it dies at */
+typedef struct {
+    long long death;
+    int id;
+    size_t size;
+} block_t;
+
+/* Global variables */
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+static block_t *heap = NULL;     /* the live blocks */
+static long long nlive = 0, maxlive = 0;
+static FILE *out;
+static int binary = 0;
+static long long nops = 0;
+
+/* Function prototypes */
+static double rnd(void);
+static void parse_dist(dist_t *d, const char *spec, const char *what);
+static double sample(const dist_t *d);
+static void push_block(block_t b);
+static block_t pop_block(void);
+static void emit(int type, int id, size_t size);
+static void usage(void);
+static void app_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+
+/*
+ * rnd - return a uniform random number in [0, 1), by xorshift64*, so
+ *     that a seed gives the same trace everywhere
+ */
+static double rnd(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (double)((rng_state * 0x2545f4914f6cdd1dULL) >> 11) / (double)(1ULL << 53);
+}
+
+/*
+ * parse_dist - read the distribution spec into d
+ */
+static void parse_dist(dist_t *d, const char *spec, const char *what)
+{
+    char *copy = strdup(spec), *term, *save = NULL, *kind;
+    double total = 0;
+    int i, n;
+
+    if (copy == NULL)
+        app_error("out of memory");
+    d->n = 0;
+    for (term = strtok_r(copy, ",", &save); term != NULL;
+         term = strtok_r(NULL, ",", &save)) {
+        if (d->n == MAXTERMS)
+            app_error("%s: more than %d terms", what, MAXTERMS);
+        i = d->n++;
+        d->terms[i].w = 1;
+        if ((kind = strchr(term, '*')) != NULL) {
+            d->terms[i].w = atof(term);
+            term = kind + 1;
+        }
+        d->terms[i].a = d->terms[i].b = d->terms[i].c = 0;
+        if ((n = sscanf(term, "fixed:%lf", &d->terms[i].a)) == 1)
+            d->terms[i].kind = FIXED;
+        else if ((n = sscanf(term, "uniform:%lf:%lf", &d->terms[i].a, &d->terms[i].b)) == 2)
+            d->terms[i].kind = UNIFORM;
+        else if ((n = sscanf(term, "pow:%lf:%lf:%lf", &d->terms[i].a, &d->terms[i].b,
+                             &d->terms[i].c)) == 3 && d->terms[i].a > 0 && d->terms[i].b > 0)
+            d->terms[i].kind = POW;
+        else if ((n = sscanf(term, "exp:%lf", &d->terms[i].a)) == 1)
+            d->terms[i].kind = EXP;
+        else if ((n = sscanf(term, "lognormal:%lf:%lf", &d->terms[i].a, &d->terms[i].b)) == 2)
+            d->terms[i].kind = LOGNORMAL;
+        else
+            app_error("%s: bad term \"%s\"", what, term);
+        if (d->terms[i].w <= 0)
+            app_error("%s: the weight of \"%s\" must be positive", what, term);
+        total += d->terms[i].w;
+    }
+    if (d->n == 0)
+        app_error("%s: no terms", what);
+
+    /* make the weights cumulative, for sample */
+    for (i = 0; i < d->n; i++)
+        d->terms[i].w = (i > 0 ? d->terms[i - 1].w : 0) + d->terms[i].w / total;
+    d->terms[d->n - 1].w = 1;
+    free(copy);
+}
+
+/*
+ * sample - draw a number from distribution d
+ */
+static double sample(const dist_t *d)
+{
+    double u = rnd(), a, b, c;
+    int i;
+
+    for (i = 0; i < d->n - 1 && u >= d->terms[i].w; i++)
+        ;
+    a = d->terms[i].a;
+    b = d->terms[i].b;
+    c = d->terms[i].c;
+    u = rnd();
+    switch (d->terms[i].kind) {
+    case FIXED:
+        return a;
+    case UNIFORM:
+        return a + u * (b - a + 1);
+    case POW:
+        /* the inverse of the CDF of the bounded Pareto distribution */
+        return b / pow(1 - u * (1 - pow(b / c, a)), 1 / a);
+    case EXP:
+        return -a * log(1 - u);
+    case LOGNORMAL:
+        /* Box-Muller */
+        return exp(a + b * sqrt(-2 * log(1 - u)) * cos(2 * M_PI * rnd()));
+    }
+    return 0;
+}
+
+/*
+ * push_block - add b to the heap of live blocks
+ */
+static void push_block(block_t b)
+{
+    long long i;
+
+    if (nlive == maxlive) {
+        maxlive = maxlive ? 2 * maxlive : 1024;
+        if ((heap = realloc(heap, maxlive * sizeof(block_t))) == NULL)
+            app_error("out of memory for %lld live blocks", maxlive);
+    }
+    for (i = nlive++; i > 0 && heap[(i - 1) / 2].death > b.death; i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = b;
+}
+
+/*
+ * pop_block - remove the block that dies first from the heap
+ */
+static block_t pop_block(void)
+{
+    block_t top = heap[0], last = heap[--nlive];
+    long long i = 0, child;
+
+    while ((child = 2 * i + 1) < nlive) {
+        if (child + 1 < nlive && heap[child + 1].death < heap[child].death)
+            child++;
+        if (heap[child].death >= last.death)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/*
+ * emit - write one request
+ */
+static void emit(int type, int id, size_t size)
+{
+    traceop_t op;
+
+    if (binary) {
+        memset(&op, 0, sizeof(op));
+        op.type = type;
+        op.index = id;
+        op.size = size;
+        if (fwrite(&op, sizeof(op), 1, out) != 1)
+            app_error("write error: %s", strerror(errno));
+    } else if (type == FREE) {
+        fprintf(out, "f %d\n", id);
+    } else {
+        fprintf(out, "%c %d %zu\n", type == ALLOC ? 'a' : 'r', id, size);
+    }
+    nops++;
+}
+
+int main(int argc, char **argv)
+{
+    dist_t sizes, lifetimes;
+    long long ops = 100000, target = 0, live_bytes = 0, peak_bytes = 0;
+    double realloc_p = 0, growth = 2;
+    int weight = 1, ids = 0;
+    size_t size, max_size = 0;
+    block_t b;
+    binheader_t header;
+    block_t *p;
+    int c;
+
+    parse_dist(&sizes, "pow:1.5:16:65536", "sizes");
+    parse_dist(&lifetimes, "exp:1000", "lifetimes");
+
+    while ((c = getopt(argc, argv, "n:S:s:l:r:t:w:bh")) != EOF) {
+        switch (c) {
+        case 'n': /* Number of requests */
+            ops = atoll(optarg);
+            break;
+        case 'S': /* Seed */
+            rng_state ^= strtoull(optarg, NULL, 0) * 0xbf58476d1ce4e5b9ULL;
+            break;
+        case 's': /* Size distribution */
+            parse_dist(&sizes, optarg, "sizes");
+            break;
+        case 'l': /* Lifetime distribution, in requests */
+            parse_dist(&lifetimes, optarg, "lifetimes");
+            break;
+        case 'r': /* Chance of a realloc, and its growth */
+            if (sscanf(optarg, "%lf:%lf", &realloc_p, &growth) < 1 ||
+                realloc_p < 0 || realloc_p > 1 || growth <= 0)
+                app_error("-r needs P[:FACTOR], a chance and a positive factor");
+            break;
+        case 't': /* Target of the live bytes */
+            target = atoll(optarg);
+            break;
+        case 'w': /* Weight of the trace */
+            weight = atoi(optarg);
+            break;
+        case 'b': /* Binary trace */
+            binary = 1;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        exit(1);
+    }
+    if (ops < 2 || ops > INT_MAX)
+        app_error("-n must be in [2, %d]", INT_MAX);
+    if ((out = fopen(argv[optind], "w")) == NULL)
+        app_error("can't open %s: %s", argv[optind], strerror(errno));
+
+    /* the header is written again at the end, with the counts */
+    memset(&header, 0, sizeof(header));
+    if (binary)
+        fwrite(&header, sizeof(header), 1, out);
+    else
+        fprintf(out, "%d\n%11d\n%11d\n0\n", weight, 0, 0);
+
+    /*
+     * Every request first frees the blocks whose time has come. Then it
+     * grows a block or allocates one, keeping room in ops to free every
+     * live block at the end. An allocation beyond the target frees the
+     * blocks that would die first, a growth beyond it is not made, and
+     * a block is never larger than the target.
+     */
+    while (nops + nlive < ops) {
+        if (nlive > 0 && heap[0].death <= nops) {
+            b = pop_block();
+            emit(FREE, b.id, 0);
+            live_bytes -= b.size;
+            continue;
+        }
+        p = NULL;
+        if (nlive > 0 && rnd() < realloc_p) {
+            /* a random live block; its place in the heap doesn't change */
+            p = &heap[(long long)(rnd() * nlive)];
+            size = (size_t)ceil(p->size * growth);
+            if (size < 1 || size > INT_MAX)
+                size = p->size;
+            if (target > 0 && live_bytes + (long long)size - (long long)p->size > target)
+                p = NULL;
+        }
+        if (p != NULL) {
+            live_bytes += (long long)size - (long long)p->size;
+            p->size = size;
+            emit(REALLOC, p->id, size);
+        } else if (nops + nlive + 2 <= ops) {
+            double s = sample(&sizes);
+            size = s < 1 ? 1 : s > INT_MAX ? INT_MAX : (size_t)s;
+            if (target > 0 && (long long)size > target)
+                size = (size_t)target;
+            while (target > 0 && nlive > 0 && live_bytes + (long long)size > target &&
+                   nops + nlive + 2 <= ops) {
+                b = pop_block();
+                emit(FREE, b.id, 0);
+                live_bytes -= b.size;
+            }
+            if (nops + nlive + 2 > ops)
+                continue;
+            b.id = ids++;
+            b.size = size;
+            b.death = nops + 1 + (long long)sample(&lifetimes);
+            emit(ALLOC, b.id, size);
+            push_block(b);
+            live_bytes += size;
+        } else {
+            break;
+        }
+        if (live_bytes > peak_bytes)
+            peak_bytes = live_bytes;
+        if (size > max_size)
+            max_size = size;
+    }
+    while (nlive > 0)
+        emit(FREE, pop_block().id, 0);
+    if (target > 0 && peak_bytes > target)
+        app_error("peak of %lld live bytes is above the target %lld", peak_bytes, target);
+
+    rewind(out);
+    if (binary) {
+        memcpy(header.magic, BIN_MAGIC, sizeof(header.magic));
+        header.weight = weight;
+        header.num_ids = ids;
+        header.num_ops = (int)nops;
+        header.op_size = sizeof(traceop_t);
+        fwrite(&header, sizeof(header), 1, out);
+    } else {
+        fprintf(out, "%d\n%11d\n%11d\n0\n", weight, ids, (int)nops);
+    }
+    if (fclose(out) != 0)
+        app_error("write error: %s", strerror(errno));
+
+    printf("%s: %lld ops, %d ids, peak of %lld live bytes, largest block %zu bytes\n",
+           argv[optind], nops, ids, peak_bytes, max_size);
+    exit(0);
+}
+
+/*
+ * usage - print the options
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gentrace [-hb] [-n <ops>] [-S <seed>] [-s <dist>] [-l <dist>] [-r <p[:factor]>]\n"
+                    "\t[-t <bytes>] [-w <weight>] <file>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-n <ops>   Write about this many requests (default 100000).\n");
+    fprintf(stderr, "\t-S <seed>  Seed of the random numbers.\n");
+    fprintf(stderr, "\t-s <dist>  Distribution of the sizes (default pow:1.5:16:65536).\n");
+    fprintf(stderr, "\t-l <dist>  Distribution of the lifetimes, in requests (default exp:1000).\n");
+    fprintf(stderr, "\t-r <p[:factor]>  Grow a live block by factor (default 2) with realloc, with chance p.\n");
+    fprintf(stderr, "\t-t <bytes> Free the blocks closest to their end early, to keep the live bytes under this.\n");
+    fprintf(stderr, "\t-w <weight> Weight of the trace (default 1).\n");
+    fprintf(stderr, "\t-b         Write a binary trace.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "A <dist> is terms [w*]fixed:N, uniform:LO:HI, pow:ALPHA:LO:HI, exp:MEAN,\n"
+                    "lognormal:MU:SIGMA, separated by commas.\n");
+}
+
+/*
+ * app_error - report an error and exit
+ */
+static void app_error(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "gentrace: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
@@ -7,9 +7,13 @@
  * Copyright (c) 2004-2015, R. Bryant and D. O'Hallaron, All rights
  * reserved.  May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* for sched_setaffinity */
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <float.h>
+#include <limits.h>
+#include <math.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -18,11 +22,19 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
+#include "perfctr.h"
 #include "config.h"
 
 /**********************
@@ -33,6 +45,14 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define DIFF_TRIES     5 /* times a round of -X is timed before it's unusable */
+
+/*
+ * Binary traces are named after the .rep file, with this suffix. The
+ * magic changes with the op types, MMTRACE1 had no batches
+ */
+#define BIN_MAGIC   "MMTRACE2"
+#define BIN_SUFFIX  ".bin"
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
@@ -54,17 +74,29 @@
  * Remember that index (-1) is the null pointer.
  */
 
-/* Records the extent of each block's payload */
+/*
+ * Records the extent of each block's payload, as a node of an AVL tree
+ * ordered by lo. The payloads in the tree never overlap, so they are
+ * ordered by hi as well, and a search by lo and hi finds any overlap.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* payloads below lo */
+    struct range_t *right; /* payloads above hi */
+    int height;            /* height of the subtree, 1 for a leaf */
     int index;             /* same index as free; for debugging */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/*
+ * Characterizes a single trace operation (allocator request). A batch of
+ * n blocks, "A id n size" or "F id n" in a trace, is n requests of ids
+ * id to id + n - 1: the first is ALLOC_BATCH or FREE_BATCH, and the rest
+ * ALLOC_NEXT or FREE_NEXT. They are replayed with mm_malloc_batch and
+ * mm_free_batch, or one by one as ALLOC and FREE
+ */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    enum { ALLOC, FREE, REALLOC, ALLOC_BATCH, FREE_BATCH, ALLOC_NEXT, FREE_NEXT } type;
     int index;                        /* index for free() to use later */
     size_t size;                      /* byte size of alloc/realloc request */
 } traceop_t;
@@ -80,8 +112,26 @@ typedef struct {
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
     int *block_rand_base;/* index into random_data, if debug is on */
+    void *map;           /* the mapped binary trace holding ops, or NULL */
+    size_t map_size;     /* and its size */
 } trace_t;
 
+/*
+ * Header of a binary trace, followed by num_ops traceop_t records, so the
+ * file is mapped as the ops of a trace without parsing. It keeps the
+ * record size of the driver that wrote it, and its size is a multiple
+ * of 8 so that the records are aligned.
+ */
+typedef struct {
+    char magic[8];       /* BIN_MAGIC */
+    int weight;
+    int num_ids;
+    int num_ops;
+    int ignore_ranges;
+    int op_size;         /* sizeof(traceop_t) */
+    int pad;
+} binheader_t;
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -92,6 +142,107 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/*
+ * An allocator built as a shared object, compared with another one by
+ * the differential benchmark (-X). Each object has its own copy of the
+ * state of mm.c, and both use the heap of memlib in the driver.
+ */
+typedef struct {
+    const char *path;
+    void *handle;
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+} variant_t;
+
+/* Params of eval_variant_speed, timed by fcyc like speed_t */
+typedef struct {
+    trace_t *trace;
+    const variant_t *variant;
+} variant_speed_t;
+
+/*
+ * Holds the params of one thread replaying a trace with the -T option.
+ * Every thread has its own blocks, and with -S it only runs the
+ * requests of the ids that belong to it.
+ */
+typedef struct {
+    trace_t *trace;
+    int tid;                    /* this thread's number */
+    int nthreads;               /* number of threads replaying at once */
+    int use_libc;               /* replay with libc malloc instead of mm */
+    char **blocks;              /* this thread's pointers for the ids */
+    pthread_barrier_t *barrier; /* to start all threads at once */
+    int ok;                     /* did every request succeed? */
+    struct timespec start, end; /* when this thread began and finished its replay */
+} replay_t;
+
+/*
+ * Streaming replay (-R): a reader thread reads the ops in chunks of
+ * STREAM_CHUNK, filling one chunk while the other is replayed, and
+ * only the live blocks are kept, in a hash map of their ids
+ */
+#define STREAM_CHUNK (1 << 16)
+
+typedef struct {
+    traceop_t *ops;             /* STREAM_CHUNK ops */
+    int n;                      /* number of ops read in it */
+    int full;                   /* read and not yet replayed */
+} chunk_t;
+
+typedef struct {
+    const char *filename;
+    FILE *file;
+    int binary;                 /* binary trace, else text */
+    int num_ids;                /* of a binary trace, to check its ops */
+    traceop_t prev;             /* the last op of a binary trace, for the same */
+    long long op_index;         /* and the number of ops read so far */
+    long long lineno;           /* of a text trace, for errors */
+    int last_size;              /* of the last request of a text trace */
+    long long left;             /* ops left by the header, -1 to read to EOF */
+    traceop_t batch;            /* the next op of a batch of a text trace... */
+    int batch_left;             /* ... and the number of its ops not yet read */
+    chunk_t chunks[2];
+    pthread_mutex_t lock;       /* protects full of the chunks */
+    pthread_cond_t cond;        /* a chunk became full or empty */
+} stream_t;
+
+/* A live block in the open addressing hash map of ids */
+typedef struct {
+    int id;
+    int used;
+    char *p;
+    size_t size;
+} live_t;
+
+typedef struct {
+    live_t *slots;
+    size_t mask;                /* number of slots - 1, a power of 2 */
+    size_t count;               /* number of live ids */
+} livemap_t;
+
+/*
+ * Latency histograms (-H): every request of a replay is timed with the
+ * cycle counter, and counted by its type and size class in buckets that
+ * are linear within each power of 2, 2^(LAT_SUB_BITS-1) of them, as in
+ * an HDR histogram, so a percentile is off by at most 1/16. Size class
+ * c holds the sizes up to LAT_MIN_CLASS * 4^c, and the last all others.
+ */
+#define LAT_SUB_BITS  5
+#define LAT_SUB       (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS   ((64 - LAT_SUB_BITS + 2) * (LAT_SUB / 2))
+#define LAT_OPS       3            /* ALLOC, FREE, REALLOC */
+#define LAT_CLASSES   8
+#define LAT_MIN_CLASS 16
+
+typedef struct {
+    unsigned long long count;   /* number of requests */
+    unsigned long long sum;     /* of their cycles, for the mean */
+    unsigned long long max;
+    unsigned long long buckets[LAT_BUCKETS];
+} lat_hist_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -106,6 +257,9 @@ typedef struct {
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
 
+    /* hardware counts of one more replay with -C, -1 if not available */
+    double counters[PERF_NUM];
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -141,6 +295,39 @@ int verbose = 1;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 int onetime_flag = 0;
 
+/* threads to replay with, 0 for no thread scaling test (-T) */
+static int max_threads = 0;
+/* split the ids of a trace across threads rather than copy it (-S) */
+static int split_ids = 0;
+/* convert the traces to binary traces and exit (-B) */
+static int convert_traces = 0;
+/* trace to replay as it's read, then exit (-R) */
+static char *stream_file = NULL;
+/* directory for snapshots of the heap at the peak of each trace (-P) */
+static char *snapshot_dir = NULL;
+/* the request where eval_mm_util found the peak of the payload */
+static int util_peak_op = 0;
+/* traces to evaluate at once in worker processes (-j) */
+static int njobs = 1;
+/* take the speed measurements of the workers one at a time (-I) */
+static int isolate_speed = 0;
+/* held by a worker while it measures speed, in shared memory */
+static pthread_mutex_t *speed_lock = NULL;
+/* count hardware events in one more replay of each trace (-C) */
+static int perf_counters = 0;
+/* print the counters of mm_stats after each trace (-m) */
+static int dump_stats = 0;
+/* file of the latency histograms, CSV or JSON by its suffix (-H) */
+static FILE *lat_file = NULL;
+static int lat_json = 0;
+static unsigned long long lat_ovhd;   /* cycles to read the counter */
+static lat_hist_t lat_trace[LAT_OPS][LAT_CLASSES];
+static lat_hist_t lat_total[LAT_OPS][LAT_CLASSES];
+
+/* two allocators to compare, a.so,b.so, and the rounds to run (-X, -N) */
+static char *diff_files = NULL;
+static int diff_rounds = 10;
+
 /* by default, no timeouts */
 static int set_timeout = 0;
 
@@ -162,15 +349,21 @@ sum_stats_t global_mm_sum_stats;
  * Function prototypes
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *find_overlap(range_t *r, char *lo, char *hi);
+static range_t *insert_range(range_t *r, range_t *p);
+static range_t *delete_range(range_t *r, char *lo);
+static range_t *balance_range(range_t *r);
+static void check_ranges(const trace_t *trace, int opnum, range_t *r);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
 static void check_index(const trace_t *trace, int opnum, int index);
+static int batch_len(const trace_t *trace, int opnum);
 static void randomize_block(trace_t *trace, int index);
 
 /* These functions read, allocate, and free storage for traces */
@@ -178,6 +371,10 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
+static void bin_name(char *bin, const char *filename);
+static int map_trace(trace_t *trace, const char *filename);
+static int check_op(const traceop_t *op, const traceop_t *prev, int num_ids);
+static void write_trace(const trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace);
@@ -187,10 +384,54 @@ static void eval_libc_speed(void *ptr);
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
+static void snapshot_peak(trace_t *trace, int tracenum);
+static void render_snapshot(const char *filename, int opnum);
 static void eval_mm_speed(void *ptr);
 
+/* these functions replay traces on many threads */
+static void *replay_thread(void *arg);
+static double eval_threads(trace_t *trace, int nthreads, int use_libc);
+static void run_thread_tests(int num_tracefiles, const char *tracedir,
+                             char **tracefiles, stats_t *mm_stats);
+
+/* this function runs the traces in worker processes */
+static void run_parallel_tests(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *mm_stats,
+                               speed_t *speed_params);
+
+/* these functions compare two builds of the allocator */
+static void load_variant(variant_t *v, const char *path);
+static double eval_variant_util(trace_t *trace, const variant_t *v);
+static void eval_variant_speed(void *ptr);
+static void diff_interval(const double *d, int n, double *mean, double *half);
+static int print_diff(const char *name, double ops, const double *util,
+                      double *const secs[2]);
+static void run_diff_tests(int num_tracefiles, const char *tracedir,
+                           char **tracefiles);
+
+/* these functions replay a trace as it's read */
+static void stream_fill(stream_t *s, chunk_t *c);
+static void *stream_reader(void *arg);
+static live_t *live_find(livemap_t *m, int id);
+static void live_grow(livemap_t *m);
+static void live_remove(livemap_t *m, live_t *slot);
+static void stream_trace(const char *filename);
+
+/* these functions keep histograms of the latency of every request */
+static int lat_bucket(unsigned long long v);
+static unsigned long long lat_bucket_hi(int b);
+static int lat_class(size_t size);
+static void lat_class_range(int c, size_t *lo, size_t *hi);
+static void lat_record(int op, size_t size, unsigned long long cycles);
+static unsigned long long lat_percentile(const lat_hist_t *h, double q);
+static void eval_mm_latency(trace_t *trace);
+static void lat_open(const char *filename);
+static void lat_write(const char *tracename, lat_hist_t hists[][LAT_CLASSES], int total);
+static void lat_close(void);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void print_mm_stats(const char *tracename);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -246,11 +487,28 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             if (verbose > 1)
                 printf("efficiency, ");
             mm_stats[i].util = eval_mm_util(trace, i);
+            if (snapshot_dir != NULL)
+                snapshot_peak(trace, i);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
+            if (speed_lock != NULL)
+                pthread_mutex_lock(speed_lock);
             mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+            if (perf_counters) {
+                perf_start();
+                eval_mm_speed(speed_params);
+                perf_stop(mm_stats[i].counters);
+            }
+            if (speed_lock != NULL)
+                pthread_mutex_unlock(speed_lock);
+            if (dump_stats)
+                print_mm_stats(trace->filename);
+            if (lat_file != NULL) {
+                eval_mm_latency(trace);
+                lat_write(trace->filename, lat_trace, 0);
+            }
         }
 
         free_trace(trace);
@@ -260,6 +518,123 @@ static void run_tests(int num_tracefiles, const char *tracedir,
     }
 }
 
+/*
+ * run_parallel_tests - run_tests with every trace in a worker process of
+ *     its own, at most njobs at once, each pinned to one of the cores this
+ *     process may run on. A worker sends its stats and errors back in a
+ *     pipe. With isolate_speed, the speed measurements are taken one at a
+ *     time, while the checks of other traces go on
+ */
+static void run_parallel_tests(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *mm_stats,
+                               speed_t *speed_params)
+{
+    pid_t *pids;
+    int *fds, *traces;
+    int cpus[CPU_SETSIZE], ncpus = 0;
+    int next = 0, running = 0, slot, status, k;
+    cpu_set_t set;
+    pthread_mutexattr_t attr;
+    pid_t pid;
+
+    if ((pids = calloc(njobs, sizeof(*pids))) == NULL ||
+        (fds = calloc(njobs, sizeof(*fds))) == NULL ||
+        (traces = calloc(njobs, sizeof(*traces))) == NULL)
+        unix_error("calloc failed in run_parallel_tests");
+
+    /* the cores to pin the workers to */
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (k = 0; k < CPU_SETSIZE; k++)
+            if (CPU_ISSET(k, &set))
+                cpus[ncpus++] = k;
+
+    if (isolate_speed) {
+        speed_lock = mmap(NULL, sizeof(*speed_lock), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (speed_lock == MAP_FAILED)
+            unix_error("mmap failed in run_parallel_tests");
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(speed_lock, &attr);
+    }
+
+    /* the timeout is for every worker, not the whole run */
+    alarm(0);
+    fflush(stdout);
+
+    while (next < num_tracefiles || running > 0) {
+        /* start workers in the free slots */
+        for (slot = 0; slot < njobs && next < num_tracefiles; slot++) {
+            int fd[2];
+
+            if (pids[slot] != 0)
+                continue;
+            if (pipe(fd) < 0)
+                unix_error("pipe failed in run_parallel_tests");
+            if ((pid = fork()) < 0)
+                unix_error("fork failed in run_parallel_tests");
+            if (pid == 0) {
+                close(fd[0]);
+                if (ncpus > 0) {
+                    CPU_ZERO(&set);
+                    CPU_SET(cpus[slot % ncpus], &set);
+                    sched_setaffinity(0, sizeof(set), &set);
+                }
+                if (set_timeout > 0)
+                    alarm(set_timeout);
+                /* the counters opened by the parent count the parent */
+                if (perf_counters)
+                    perf_init();
+                errors = 0;
+                run_tests(1, tracedir, &tracefiles[next], &mm_stats[next],
+                          NULL, speed_params);
+                if (write(fd[1], &mm_stats[next], sizeof(stats_t)) != sizeof(stats_t) ||
+                    write(fd[1], &errors, sizeof(errors)) != sizeof(errors))
+                    exit(1);
+                exit(0);
+            }
+            close(fd[1]);
+            pids[slot] = pid;
+            fds[slot] = fd[0];
+            traces[slot] = next++;
+            running++;
+        }
+
+        /* merge the results of a worker that has finished */
+        if ((pid = wait(&status)) < 0)
+            unix_error("wait failed in run_parallel_tests");
+        for (slot = 0; slot < njobs && pids[slot] != pid; slot++)
+            ;
+        if (slot == njobs)
+            continue;
+        k = traces[slot];
+        if (read(fds[slot], &mm_stats[k], sizeof(stats_t)) == sizeof(stats_t)) {
+            int worker_errors;
+
+            if (read(fds[slot], &worker_errors, sizeof(worker_errors)) == sizeof(worker_errors))
+                errors += worker_errors;
+        } else {
+            /* the worker crashed before it could send anything */
+            fprintf(stderr, "The worker of %s failed\n", tracefiles[k]);
+            strcpy(mm_stats[k].filename, tracefiles[k]);
+            mm_stats[k].valid = 0;
+            errors++;
+        }
+        close(fds[slot]);
+        pids[slot] = 0;
+        running--;
+    }
+
+    if (speed_lock != NULL) {
+        pthread_mutex_destroy(speed_lock);
+        munmap(speed_lock, sizeof(*speed_lock));
+        speed_lock = NULL;
+    }
+    free(pids);
+    free(fds);
+    free(traces);
+}
+
 /**************
  * Main routine
  **************/
@@ -291,7 +666,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:T:R:H:P:j:X:N:hpVAlDSBmCI")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -352,6 +727,60 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'T': /* Replay on up to n threads */
+            max_threads = atoi(optarg);
+            if (max_threads < 1)
+                app_error("-T needs at least one thread");
+            break;
+
+        case 'S': /* Split ids across threads with -T */
+            split_ids = 1;
+            break;
+
+        case 'B': /* Write a binary trace for every trace and exit */
+            convert_traces = 1;
+            break;
+
+        case 'R': /* Replay one trace as it's read, and exit */
+            stream_file = strdup(optarg);
+            break;
+
+        case 'P': /* Snapshot the heap at the peak of each trace */
+            snapshot_dir = strdup(optarg);
+            break;
+
+        case 'j': /* Evaluate traces in parallel worker processes */
+            njobs = atoi(optarg);
+            if (njobs < 1)
+                app_error("-j needs at least one job");
+            break;
+
+        case 'I': /* Isolate the speed measurements of workers */
+            isolate_speed = 1;
+            break;
+
+        case 'X': /* Compare two builds of the allocator */
+            diff_files = strdup(optarg);
+            break;
+
+        case 'N': /* Rounds of the comparison */
+            diff_rounds = atoi(optarg);
+            if (diff_rounds < 2)
+                app_error("-N needs at least two rounds");
+            break;
+
+        case 'C': /* Count hardware events of every trace */
+            perf_counters = 1;
+            break;
+
+        case 'm': /* Print the counters of mm after each trace */
+            dump_stats = 1;
+            break;
+
+        case 'H': /* Write latency histograms */
+            lat_open(optarg);
+            break;
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -362,18 +791,46 @@ int main(int argc, char **argv)
         }
     }
 
+    if (stream_file != NULL) {
+        stream_trace(stream_file);
+        exit(0);
+    }
+
+    /* the histograms of the workers would be lost */
+    if (njobs > 1 && lat_file != NULL)
+        app_error("-H can't be used with -j");
+
     if (tracefiles == NULL) {
         tracefiles = default_tracefiles;
         num_tracefiles = sizeof(default_tracefiles) / sizeof(char *) - 1;
         printf("Using default tracefiles in %s\n", tracedir);
     }
 
+    if (convert_traces) {
+        stats_t stats;
+        for (i = 0; i < num_tracefiles; i++) {
+            trace_t *trace = read_trace(&stats, tracedir, tracefiles[i]);
+            write_trace(trace);
+            free_trace(trace);
+        }
+        exit(0);
+    }
+
     if(debug_mode != DBG_NONE) {
         init_random_data();
     }
 
     /* Initialize the timing package */
     init_fsecs();
+    if (perf_counters && perf_init() == 0) {
+        fprintf(stderr, "No hardware counters can be opened, ignoring -C\n");
+        perf_counters = 0;
+    }
+
+    if (diff_files != NULL) {
+        run_diff_tests(num_tracefiles, tracedir, tracefiles);
+        exit(0);
+    }
 
     /* Initialize the timeout */
     if (set_timeout > 0) {
@@ -405,6 +862,11 @@ int main(int argc, char **argv)
                 if (verbose > 1)
                     printf("and performance.\n");
                 libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+                if (perf_counters) {
+                    perf_start();
+                    eval_libc_speed(&speed_params);
+                    perf_stop(libc_stats[i].counters);
+                }
             }
             free_trace(trace);
         }
@@ -428,8 +890,12 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
-    run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
-              ranges, &speed_params);
+    if (njobs > 1 && !onetime_flag)
+        run_parallel_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
+                           &speed_params);
+    else
+        run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
+                  ranges, &speed_params);
 
 
     /* Display the mm results in a compact table */
@@ -447,6 +913,8 @@ int main(int argc, char **argv)
             printf("\n");
         }
     }
+    if (lat_file != NULL)
+        lat_close();
 
     /* Optionally compare the performance of mm and libc */
     if (run_libc) {
@@ -455,6 +923,10 @@ int main(int argc, char **argv)
                (float)(global_mm_sum_stats.tput/global_libc_sum_stats.tput));
     }
 
+    /* Optionally measure how mm and libc scale with threads */
+    if (max_threads > 0 && !onetime_flag)
+        run_thread_tests(num_tracefiles, tracedir, tracefiles, mm_stats);
+
     /*
      * Accumulate the aggregate statistics for the student's mm package
      */
@@ -580,16 +1052,17 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range tree, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks, in time
+ * logarithmic in the number of blocks, so every trace is checked.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range tree.
  */
 static int add_range(range_t **ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index)
@@ -607,41 +1080,36 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    if (!mem_in_heap(lo, hi)) {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
         return 0;
     }
 
-    /* If we can't afford the linear-time loop, we check less thoroughly and
-       just assume the overlap will be caught by writing random bits. */
-    if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
-
+    /* Without debugging, the overlap is caught by writing random bits. */
+    if(debug_mode == DBG_NONE) return 1;
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-            malloc_error(trace, opnum,
-                         "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-                         lo, hi, p->lo, p->hi);
-            return 0;
-        }
+    if ((p = find_overlap(*ranges, lo, hi)) != NULL) {
+        malloc_error(trace, opnum,
+                     "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+                     lo, hi, p->lo, p->hi);
+        return 0;
     }
 
     /*
      * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
         unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
+    p->left = p->right = NULL;
+    p->height = 1;
     p->index = index;
-    *ranges = p;
+    *ranges = insert_range(*ranges, p);
 
     return 1;
 }
@@ -651,32 +1119,149 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
+    *ranges = delete_range(*ranges, lo);
+}
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-            *prevpp = p->next;
-            free(p);
-            break;
+/*
+ * clear_ranges - free all of the range records for a trace
+ */
+static void clear_ranges(range_t **ranges)
+{
+    range_t *p = *ranges;
+
+    if (p == NULL)
+        return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    free(p);
+    *ranges = NULL;
+}
+
+/*
+ * find_overlap - return a payload in tree r that overlaps lo to hi,
+ *     or NULL. The payloads in r are disjoint, so a subtree is
+ *     skipped when it lies wholly on one side of lo to hi.
+ */
+static range_t *find_overlap(range_t *r, char *lo, char *hi)
+{
+    while (r != NULL) {
+        if (hi < r->lo)
+            r = r->left;
+        else if (lo > r->hi)
+            r = r->right;
+        else
+            return r;
+    }
+    return NULL;
+}
+
+#define RANGE_HEIGHT(r) ((r) == NULL ? 0 : (r)->height)
+
+/*
+ * balance_range - fix the height of r, whose subtrees are balanced and
+ *     differ in height by at most 2, and rotate it to balance it.
+ *     Return the new root of the subtree.
+ */
+static range_t *balance_range(range_t *r)
+{
+    range_t *p;
+    int diff = RANGE_HEIGHT(r->left) - RANGE_HEIGHT(r->right);
+
+    if (diff > 1) {
+        /* left heavy; first rotate the left child left if it leans right */
+        p = r->left;
+        if (RANGE_HEIGHT(p->left) < RANGE_HEIGHT(p->right)) {
+            r->left = p->right;
+            p->right = r->left->left;
+            r->left->left = p;
+            balance_range(p);
+            p = r->left;
+        }
+        r->left = p->right;
+        p->right = r;
+        balance_range(r);
+        r = p;
+    } else if (diff < -1) {
+        /* right heavy, the mirror image */
+        p = r->right;
+        if (RANGE_HEIGHT(p->right) < RANGE_HEIGHT(p->left)) {
+            r->right = p->left;
+            p->left = r->right->right;
+            r->right->right = p;
+            balance_range(p);
+            p = r->right;
         }
-        prevpp = &(p->next);
+        r->right = p->left;
+        p->left = r;
+        balance_range(r);
+        r = p;
     }
+    diff = RANGE_HEIGHT(r->left) - RANGE_HEIGHT(r->right);
+    r->height = (diff > 0 ? RANGE_HEIGHT(r->left) : RANGE_HEIGHT(r->right)) + 1;
+    return r;
 }
 
 /*
- * clear_ranges - free all of the range records for a trace
+ * insert_range - add the range p to tree r, which it doesn't overlap,
+ *     and return the new root
  */
-static void clear_ranges(range_t **ranges)
+static range_t *insert_range(range_t *r, range_t *p)
+{
+    if (r == NULL)
+        return p;
+    if (p->lo < r->lo)
+        r->left = insert_range(r->left, p);
+    else
+        r->right = insert_range(r->right, p);
+    return balance_range(r);
+}
+
+/*
+ * delete_range - free the range in tree r that starts at lo, if any,
+ *     and return the new root
+ */
+static range_t *delete_range(range_t *r, char *lo)
 {
     range_t *p;
-    range_t *pnext;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
+    if (r == NULL)
+        return NULL;
+    if (lo < r->lo) {
+        r->left = delete_range(r->left, lo);
+    } else if (lo > r->lo) {
+        r->right = delete_range(r->right, lo);
+    } else {
+        p = r;
+        if (r->left == NULL) {
+            r = r->right;
+        } else if (r->right == NULL) {
+            r = r->left;
+        } else {
+            /* move the range after lo here, then free the node */
+            for (r = p->right; r->left != NULL; r = r->left)
+                ;
+            p->lo = r->lo;
+            p->hi = r->hi;
+            p->index = r->index;
+            p->right = delete_range(p->right, r->lo);
+            return balance_range(p);
+        }
         free(p);
+        if (r == NULL)
+            return NULL;
+    }
+    return balance_range(r);
+}
+
+/*
+ * check_ranges - check the data of every block in tree r
+ */
+static void check_ranges(const trace_t *trace, int opnum, range_t *r)
+{
+    for (; r != NULL; r = r->right) {
+        check_ranges(trace, opnum, r->left);
+        check_index(trace, opnum, r->index);
     }
-    *ranges = NULL;
 }
 
 /**********************************************
@@ -745,8 +1330,147 @@ static void check_index(const trace_t *trace, int opnum, int index) {
  * The following routines manipulate tracefiles
  *********************************************/
 
+/*
+ * batch_len - return the number of requests of the batch that starts
+ *     at request opnum
+ */
+static int batch_len(const trace_t *trace, int opnum)
+{
+    int next = (trace->ops[opnum].type == ALLOC_BATCH) ? ALLOC_NEXT : FREE_NEXT;
+    int n = 1;
+
+    while (opnum + n < trace->num_ops && (int)trace->ops[opnum + n].type == next)
+        n++;
+    return n;
+}
+
+/*
+ * bin_name - the name of the binary trace for filename, with the .rep
+ *     suffix, if any, replaced by BIN_SUFFIX
+ */
+static void bin_name(char *bin, const char *filename)
+{
+    size_t len = strlen(filename);
+
+    if (len > 4 && strcmp(filename + len - 4, ".rep") == 0)
+        len -= 4;
+    if (len + strlen(BIN_SUFFIX) >= MAXLINE)
+        app_error("%s: name too long for a binary trace", filename);
+    memcpy(bin, filename, len);
+    strcpy(bin + len, BIN_SUFFIX);
+}
+
+/*
+ * map_trace - map binary trace filename as the header and ops of trace
+ *     return 0 if it's not a binary trace of this driver
+ */
+static int map_trace(trace_t *trace, const char *filename)
+{
+    binheader_t *header;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(binheader_t)) {
+        close(fd);
+        return 0;
+    }
+    /* private and writable, so that the ops can be changed like read ones */
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+    header = (binheader_t *)map;
+    if (memcmp(header->magic, BIN_MAGIC, sizeof(header->magic)) != 0 ||
+        header->op_size != sizeof(traceop_t)) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    if (header->num_ops < 0 || header->num_ids < 0 ||
+        (size_t)st.st_size != sizeof(binheader_t) + header->num_ops * sizeof(traceop_t))
+        app_error("%s: truncated binary trace", filename);
+    /* the checks of read_trace, the ops are replayed without any */
+    if (header->weight < 0 || header->weight > 3)
+        app_error("%s: weight can only be in {0, 1, 2 3}", filename);
+    if (header->ignore_ranges != 0 && header->ignore_ranges != 1)
+        app_error("%s: ignore-ranges can only be zero or one", filename);
+    for (int i = 0; i < header->num_ops; i++)
+        if (!check_op((traceop_t *)(header + 1) + i, i ? (traceop_t *)(header + 1) + i - 1 : NULL,
+                      header->num_ids))
+            app_error("%s: bad request %d in binary trace", filename, i);
+
+    trace->weight = header->weight;
+    trace->num_ids = header->num_ids;
+    trace->num_ops = header->num_ops;
+    trace->ignore_ranges = header->ignore_ranges;
+    trace->ops = (traceop_t *)(header + 1);
+    trace->map = map;
+    trace->map_size = st.st_size;
+    return 1;
+}
+
+/*
+ * check_op - return whether op of a binary trace is a request that
+ *     read_trace could give: a known type, an id below num_ids (-1 to free
+ *     NULL), a size that fits in an int, and the op after prev in a batch
+ *     if it continues one
+ */
+static int check_op(const traceop_t *op, const traceop_t *prev, int num_ids)
+{
+    if (op->index < (op->type == FREE ? -1 : 0) || op->index >= num_ids ||
+        op->size > INT_MAX)
+        return 0;
+    switch (op->type) {
+    case ALLOC:
+    case FREE:
+    case REALLOC:
+    case ALLOC_BATCH:
+    case FREE_BATCH:
+        return 1;
+    case ALLOC_NEXT:
+    case FREE_NEXT:
+        return prev != NULL && prev->index + 1 == op->index && prev->size == op->size &&
+               (op->type == ALLOC_NEXT ? (prev->type == ALLOC_BATCH || prev->type == ALLOC_NEXT)
+                                       : (prev->type == FREE_BATCH || prev->type == FREE_NEXT));
+    default:
+        return 0;
+    }
+}
+
+/*
+ * write_trace - write trace as a binary trace next to its file
+ */
+static void write_trace(const trace_t *trace)
+{
+    char bin[MAXLINE];
+    binheader_t header;
+    FILE *binfile;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BIN_MAGIC, sizeof(header.magic));
+    header.weight = trace->weight;
+    header.num_ids = trace->num_ids;
+    header.num_ops = trace->num_ops;
+    header.ignore_ranges = trace->ignore_ranges;
+    header.op_size = sizeof(traceop_t);
+
+    bin_name(bin, trace->filename);
+    if ((binfile = fopen(bin, "w")) == NULL)
+        unix_error("Could not open %s in write_trace", bin);
+    if (fwrite(&header, sizeof(header), 1, binfile) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, binfile) != (size_t)trace->num_ops ||
+        fclose(binfile) != 0)
+        unix_error("Could not write %s in write_trace", bin);
+    if (verbose > 1)
+        printf("Wrote binary trace: %s\n", bin);
+}
+
 /*
  * read_trace - read a trace file and store it in memory
+ *     a binary trace is mapped instead of parsed, either the file itself
+ *     or the one next to it if it's not older than the file
  */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename)
@@ -754,7 +1478,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     FILE *tracefile;
     trace_t *trace;
     char type[MAXLINE];
-    int index, size;
+    int index, size, count;
     int max_index = 0;
     int op_index;
 
@@ -765,9 +1489,24 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
         unix_error("malloc 1 failed in read_trace");
 
-    /* Read the trace file header */
     strcpy(trace->filename, tracedir);
     strcat(trace->filename, filename);
+    trace->map = NULL;
+    if (!convert_traces) {
+        char bin[MAXLINE];
+        struct stat rep_st, bin_st;
+
+        bin_name(bin, trace->filename);
+        if (map_trace(trace, trace->filename) ||
+            (stat(trace->filename, &rep_st) == 0 && stat(bin, &bin_st) == 0 &&
+             bin_st.st_mtime >= rep_st.st_mtime && map_trace(trace, bin))) {
+            if (verbose > 1)
+                printf("Mapped binary trace: %s\n", trace->filename);
+            goto loaded;
+        }
+    }
+
+    /* Read the trace file header */
     if ((tracefile = fopen(trace->filename, "r")) == NULL) {
         unix_error("Could not open %s in read_trace", trace->filename);
     }
@@ -788,21 +1527,6 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
          (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
         unix_error("malloc 2 failed in read_trace");
 
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks =
-         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
-        unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes =
-         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
-        unix_error("malloc 4 failed in read_trace");
-
-    /* and, if we're debugging, the offset into the random data */
-    if ((trace->block_rand_base =
-         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
-        unix_error("malloc 5 failed in read_trace");
-
 
     /* read every request line in the trace file */
     index = 0;
@@ -828,6 +1552,26 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
             break;
+        case 'A':
+        case 'F':
+            /* a batch, one request per block */
+            size = 0;
+            if (fscanf(tracefile, "%u %u", &index, &count) != 2 ||
+                (type[0] == 'A' && fscanf(tracefile, "%u", &size) != 1) ||
+                count < 1 || count > trace->num_ops - op_index)
+                app_error("Bad batch at request %d of tracefile %s\n",
+                          op_index, trace->filename);
+            for (int k = 0; k < count; k++) {
+                if (k > 0)
+                    op_index++;
+                trace->ops[op_index].type = (type[0] == 'A') ? (k ? ALLOC_NEXT : ALLOC_BATCH)
+                                                             : (k ? FREE_NEXT : FREE_BATCH);
+                trace->ops[op_index].index = index + k;
+                trace->ops[op_index].size = size;
+            }
+            if (type[0] == 'A' && index + count - 1 > max_index)
+                max_index = index + count - 1;
+            break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n",
                       type[0], trace->filename);
@@ -839,6 +1583,22 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
 
+loaded:
+    /* We'll keep an array of pointers to the allocated blocks here... */
+    if ((trace->blocks =
+         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+        unix_error("malloc 3 failed in read_trace");
+
+    /* ... along with the corresponding byte sizes of each block */
+    if ((trace->block_sizes =
+         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
+        unix_error("malloc 4 failed in read_trace");
+
+    /* and, if we're debugging, the offset into the random data */
+    if ((trace->block_rand_base =
+         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+        unix_error("malloc 5 failed in read_trace");
+
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
@@ -863,8 +1623,11 @@ static void reinit_trace(trace_t *trace)
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);
+    if (trace->map != NULL)   /* unmap or free the ops... */
+        munmap(trace->map, trace->map_size);
+    else
+        free(trace->ops);
+    free(trace->blocks);      /* and the three arrays... */
     free(trace->block_sizes);
     free(trace->block_rand_base);
     free(trace);              /* and the trace record itself... */
@@ -880,14 +1643,14 @@ static void free_trace(trace_t *trace)
  */
 static int eval_mm_valid(trace_t *trace, range_t **ranges)
 {
-    int i;
+    int i, k, n;
     int index;
     size_t size;
     char *newp;
     char *oldp;
     char *p;
 
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
     reinit_trace(trace);
@@ -904,17 +1667,11 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
         size = trace->ops[i].size;
 
         if(debug_mode == DBG_EXPENSIVE) {
-            range_t *r;
-                        
             /* Let the students check their own heap */
             mm_checkheap(verbose);
 
             /* Now check that all our allocated blocks have the right data */
-            r = *ranges;
-            while(r) {
-                check_index(trace, i, r->index);
-                r = r->next;
-            }
+            check_ranges(trace, i, *ranges);
         }
 
         switch (trace->ops[i].type) {
@@ -929,7 +1686,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
             /*
              * Test the range of the new block for correctness and add it
-             * to the range list if OK. The block must be  be aligned properly,
+             * to the range tree if OK. The block must be  be aligned properly,
              * and must not overlap any currently allocated block.
              */
             if (add_range(ranges, p, size, trace, i, index) == 0)
@@ -960,10 +1717,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
             }
 
 
-            /* Remove the old region from the range list */
+            /* Remove the old region from the range tree */
             remove_range(ranges, oldp);
 
-            /* Check new block for correctness and add it to range list */
+            /* Check new block for correctness and add it to range tree */
             if (size > 0) {
                 if(add_range(ranges, newp, size, trace, i, index) == 0)
                     return 0;
@@ -996,6 +1753,40 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
             mm_free(p);
             break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            n = batch_len(trace, i);
+            if (mm_malloc_batch(size, n, (void **)&trace->blocks[index]) != (size_t)n) {
+                malloc_error(trace, i, "mm_malloc_batch failed.");
+                return 0;
+            }
+            for (k = 0; k < n; k++) {
+                /* the checks of every op but the first, which ran above */
+                if (k > 0 && debug_mode == DBG_EXPENSIVE) {
+                    mm_checkheap(verbose);
+                    check_ranges(trace, i + k, *ranges);
+                }
+                if (add_range(ranges, trace->blocks[index + k], size, trace, i + k, index + k) == 0)
+                    return 0;
+                trace->block_sizes[index + k] = size;
+                randomize_block(trace, index + k);
+            }
+            i += n - 1;
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            n = batch_len(trace, i);
+            for (k = 0; k < n; k++) {
+                if (k > 0 && debug_mode == DBG_EXPENSIVE) {
+                    mm_checkheap(verbose);
+                    check_ranges(trace, i + k, *ranges);
+                }
+                check_index(trace, i + k, index + k);
+                remove_range(ranges, trace->blocks[index + k]);
+            }
+            mm_free_batch((void **)&trace->blocks[index], n);
+            i += n - 1;
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -1011,16 +1802,15 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap in bytes while running the student's malloc
+ *   package on the trace, counting the regions from mem_map too. The
+ *   heap may be shrunk, so the size at the end is not the peak.
  *
  *   A higher number is better: 1 is optimal.
  */
 static double eval_mm_util(trace_t *trace, int tracenum)
 {
-    int i;
+    int i, k, n;
     int index;
     int size, newsize, oldsize;
     int max_total_size = 0;
@@ -1029,6 +1819,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     char *newp, *oldp;
 
     reinit_trace(trace);
+    util_peak_op = 0;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
@@ -1087,34 +1878,189 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             total_size -= size;
             break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            n = batch_len(trace, i);
+
+            if (mm_malloc_batch(size, n, (void **)&trace->blocks[index]) != (size_t)n)
+                app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+                          tracenum);
+            for (k = 0; k < n; k++)
+                trace->block_sizes[index + k] = size;
+
+            total_size += n * size;
+            i += n - 1;
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            n = batch_len(trace, i);
+            for (k = 0; k < n; k++)
+                total_size -= trace->block_sizes[index + k];
+
+            mm_free_batch((void **)&trace->blocks[index], n);
+            i += n - 1;
+            break;
+
         default:
             app_error("trace %d: Nonexistent request type in eval_mm_util",
                       tracenum);
         }
 
         /* update the high-water mark */
-        max_total_size = (total_size > max_total_size) ?
-            total_size : max_total_size;
+        if (total_size > max_total_size) {
+            max_total_size = total_size;
+            util_peak_op = i;
+        }
     }
 
     printf(".");
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * snapshot_peak - replay a trace up to the request where eval_mm_util
+ *     found the peak of the payload, write the snapshot of the heap
+ *     there to a file in snapshot_dir, and render it
  */
-static void eval_mm_speed(void *ptr)
+static void snapshot_peak(trace_t *trace, int tracenum)
 {
-    int i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
-    reinit_trace(trace);
+    char filename[2 * MAXLINE];
+    const char *base = strrchr(trace->filename, '/');
+    char *dot;
+    FILE *out;
+    int i, n, index;
+    char *p;
 
-    /* Reset the heap and initialize the mm package */
+    base = (base == NULL) ? trace->filename : base + 1;
+    sprintf(filename, "%s/%s", snapshot_dir, base);
+    if ((dot = strrchr(filename, '.')) != NULL && dot > filename + strlen(snapshot_dir))
+        *dot = '\0';
+    strcat(filename, ".json");
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("trace %d: mm_init failed in snapshot_peak", tracenum);
+
+    for (i = 0;  i <= util_peak_op && i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+                app_error("trace %d: mm_malloc failed in snapshot_peak", tracenum);
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+            if (p == NULL && trace->ops[i].size != 0)
+                app_error("trace %d: mm_realloc failed in snapshot_peak", tracenum);
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free((index < 0) ? NULL : trace->blocks[index]);
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            n = batch_len(trace, i);
+            if (mm_malloc_batch(trace->ops[i].size, n, (void **)&trace->blocks[index]) != (size_t)n)
+                app_error("trace %d: mm_malloc_batch failed in snapshot_peak", tracenum);
+            i += n - 1;
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            n = batch_len(trace, i);
+            mm_free_batch((void **)&trace->blocks[index], n);
+            i += n - 1;
+            break;
+
+        default:
+            app_error("trace %d: Nonexistent request type in snapshot_peak", tracenum);
+        }
+    }
+
+    if ((out = fopen(filename, "w")) == NULL)
+        unix_error("Could not open %s for the heap snapshot", filename);
+    mm_heap_snapshot(out);
+    fclose(out);
+    render_snapshot(filename, util_peak_op);
+}
+
+/*
+ * render_snapshot - print the fragmentation histogram of a heap snapshot
+ *     from mm_heap_snapshot, the free blocks by the power of 2 of their
+ *     size, with bars of their bytes
+ */
+static void render_snapshot(const char *filename, int opnum)
+{
+    unsigned long counts[64] = {0}, bytes[64] = {0};
+    unsigned long offset, size, blocks = 0, free_bytes = 0, alloc_bytes = 0;
+    unsigned long largest = 0, run_bytes = 0, most = 0;
+    char line[MAXLINE], state;
+    FILE *in;
+    int c, bar;
+
+    if ((in = fopen(filename, "r")) == NULL)
+        unix_error("Could not open heap snapshot %s", filename);
+    while (fgets(line, MAXLINE, in) != NULL) {
+        if (sscanf(line, "[%lu,%lu,\"%c\"", &offset, &size, &state) != 3)
+            continue;
+        blocks++;
+        if (state == 'a') {
+            alloc_bytes += size;
+        } else if (state == 'r') {
+            run_bytes += size;
+        } else {
+            for (c = 0; (2UL << c) <= size; c++)
+                ;
+            counts[c]++;
+            bytes[c] += size;
+            free_bytes += size;
+            if (size > largest)
+                largest = size;
+            if (bytes[c] > most)
+                most = bytes[c];
+        }
+    }
+    fclose(in);
+
+    printf("\nHeap at request %d, the peak of payload, in %s:\n", opnum, filename);
+    printf("  %lu blocks, %lu bytes allocated, %lu in runs, %lu free\n",
+           blocks, alloc_bytes, run_bytes, free_bytes);
+    printf("  largest free block %lu bytes, fragmentation %.0f%%\n", largest,
+           free_bytes ? 100.0 * (1.0 - (double)largest / free_bytes) : 0.0);
+    if (free_bytes == 0)
+        return;
+    printf("  %20s %8s %10s\n", "free block size", "blocks", "bytes");
+    for (c = 0; c < 64; c++) {
+        if (counts[c] == 0)
+            continue;
+        sprintf(line, "%lu-%lu", 1UL << c, (2UL << c) - 1);
+        printf("  %20s %8lu %10lu ", line, counts[c], bytes[c]);
+        for (bar = (int)((40.0 * bytes[c] + most - 1) / most); bar > 0; bar--)
+            putchar('#');
+        putchar('\n');
+    }
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr)
+{
+    int i, n, index, size, newsize;
+    char *p, *newp, *oldp, *block;
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    reinit_trace(trace);
+
+    /* Reset the heap and initialize the mm package */
     mem_reset_brk();
     if (mm_init() < 0)
         app_error("mm_init failed in eval_mm_speed");
@@ -1150,11 +2096,1066 @@ static void eval_mm_speed(void *ptr)
             mm_free(block);
             break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            n = batch_len(trace, i);
+            if (mm_malloc_batch(trace->ops[i].size, n, (void **)&trace->blocks[index]) != (size_t)n)
+                app_error("mm_malloc_batch error in eval_mm_speed");
+            i += n - 1;
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            n = batch_len(trace, i);
+            mm_free_batch((void **)&trace->blocks[index], n);
+            i += n - 1;
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_speed");
         }
 }
 
+/*
+ * replay_thread - replay the requests of one thread, see replay_t
+ */
+static void *replay_thread(void *arg)
+{
+    replay_t *r = (replay_t *)arg;
+    trace_t *trace = r->trace;
+    int i, index;
+    char *p;
+
+    r->ok = 1;
+    pthread_barrier_wait(r->barrier);
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        if (split_ids && index >= 0 && index % r->nthreads != r->tid)
+            continue;
+
+        /* the ids of a batch may be split among the threads */
+        switch (trace->ops[i].type) {
+        case ALLOC:
+        case ALLOC_BATCH:
+        case ALLOC_NEXT:
+            p = r->use_libc ? malloc(trace->ops[i].size)
+                            : mm_malloc(trace->ops[i].size);
+            if (p == NULL)
+                r->ok = 0;
+            r->blocks[index] = p;
+            break;
+
+        case REALLOC:
+            p = r->use_libc ? realloc(r->blocks[index], trace->ops[i].size)
+                            : mm_realloc(r->blocks[index], trace->ops[i].size);
+            if (p == NULL && trace->ops[i].size != 0)
+                r->ok = 0;
+            r->blocks[index] = p;
+            break;
+
+        case FREE:
+        case FREE_BATCH:
+        case FREE_NEXT:
+            p = (index < 0) ? NULL : r->blocks[index];
+            if (r->use_libc)
+                free(p);
+            else
+                mm_free(p);
+            if (index >= 0)
+                r->blocks[index] = NULL;
+            break;
+
+        default:
+            app_error("Nonexistent request type in replay_thread");
+        }
+        /* leave the rest of the trace after a failure */
+        if (!r->ok)
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &r->end);
+    pthread_barrier_wait(r->barrier);
+    return NULL;
+}
+
+/*
+ * eval_threads - replay trace on nthreads threads at once with mm or
+ *     libc malloc, and return the best elapsed secs of a few runs, or
+ *     -1 if some request failed (e.g. the copies don't fit in the heap)
+ */
+static double eval_threads(trace_t *trace, int nthreads, int use_libc)
+{
+    pthread_t *tids;
+    replay_t *replays;
+    pthread_barrier_t barrier;
+    double start, end, secs, best = -1;
+    int run, t, ok;
+
+    tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    replays = (replay_t *)calloc(nthreads, sizeof(replay_t));
+    if (tids == NULL || replays == NULL)
+        unix_error("malloc failed in eval_threads");
+    for (t = 0; t < nthreads; t++) {
+        replays[t].trace = trace;
+        replays[t].tid = t;
+        replays[t].nthreads = nthreads;
+        replays[t].use_libc = use_libc;
+        if ((replays[t].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+            unix_error("calloc failed in eval_threads");
+    }
+
+    for (run = 0; run < 3; run++) {
+        if (!use_libc) {
+            mem_reset_brk();
+            if (mm_init() < 0)
+                app_error("mm_init failed in eval_threads");
+        }
+        pthread_barrier_init(&barrier, NULL, nthreads + 1);
+        for (t = 0; t < nthreads; t++) {
+            memset(replays[t].blocks, 0, trace->num_ids * sizeof(char *));
+            replays[t].barrier = &barrier;
+            if (pthread_create(&tids[t], NULL, replay_thread, &replays[t]) != 0)
+                unix_error("pthread_create failed in eval_threads");
+        }
+        /* the threads time themselves, this one may run late */
+        pthread_barrier_wait(&barrier);
+        pthread_barrier_wait(&barrier);
+
+        ok = 1;
+        start = end = 0;
+        for (t = 0; t < nthreads; t++) {
+            double t_start, t_end;
+
+            pthread_join(tids[t], NULL);
+            ok &= replays[t].ok;
+            t_start = replays[t].start.tv_sec + replays[t].start.tv_nsec / 1e9;
+            t_end = replays[t].end.tv_sec + replays[t].end.tv_nsec / 1e9;
+            /* from the earliest start to the latest end */
+            if (t == 0 || t_start < start)
+                start = t_start;
+            if (t == 0 || t_end > end)
+                end = t_end;
+        }
+        pthread_barrier_destroy(&barrier);
+
+        /* libc blocks have to go back, the mm heap is just reset */
+        if (use_libc)
+            for (t = 0; t < nthreads; t++)
+                for (int i = 0; i < trace->num_ids; i++)
+                    free(replays[t].blocks[i]);
+        if (!ok) {
+            best = -1;
+            break;
+        }
+        secs = end - start;
+        if (best < 0 || secs < best)
+            best = secs;
+    }
+
+    for (t = 0; t < nthreads; t++)
+        free(replays[t].blocks);
+    free(replays);
+    free(tids);
+    return best;
+}
+
+/*
+ * run_thread_tests - replay the valid traces that count for throughput
+ *     on 1, 2, 4, ... max_threads threads, and print the Kops of mm and
+ *     libc for every number of threads. Every thread replays a copy of
+ *     the trace, or its share of the ids with -S.
+ */
+static void run_thread_tests(int num_tracefiles, const char *tracedir,
+                             char **tracefiles, stats_t *mm_stats)
+{
+    stats_t stats;
+    trace_t *trace;
+    double ops, mm_secs, libc_secs, secs;
+    int nthreads, i, mm_ok;
+
+    printf("\nThread scaling (%s):\n", split_ids ? "ids split across threads"
+                                                : "a copy of trace per thread");
+#ifndef MM_THREADS
+    printf("mm is not thread-safe, use make MMFLAGS=-DMM_THREADS to run it on many threads\n");
+#endif
+    printf("%8s%10s%12s%12s\n", "threads", "ops", "mm Kops", "libc Kops");
+
+    for (nthreads = 1; ; nthreads = (2 * nthreads > max_threads && nthreads < max_threads)
+                                        ? max_threads : 2 * nthreads) {
+        ops = mm_secs = libc_secs = 0;
+        mm_ok = 1;
+        for (i = 0; i < num_tracefiles; i++) {
+            if (!mm_stats[i].valid ||
+                (mm_stats[i].weight != WALL && mm_stats[i].weight != WPERF))
+                continue;
+            mem_init();
+            trace = read_trace(&stats, tracedir, tracefiles[i]);
+#ifndef MM_THREADS
+            if (nthreads > 1)
+                mm_ok = 0;
+            else
+#endif
+            if (mm_ok) {
+                if ((secs = eval_threads(trace, nthreads, 0)) < 0)
+                    mm_ok = 0;
+                mm_secs += secs;
+            }
+            libc_secs += eval_threads(trace, nthreads, 1);
+            ops += split_ids ? trace->num_ops : (double)trace->num_ops * nthreads;
+            if (verbose > 1)
+                printf("  %d threads: %s\n", nthreads, trace->filename);
+            free_trace(trace);
+            mem_deinit();
+        }
+
+        if (mm_ok && mm_secs > 0)
+            printf("%8d%10.0f%12.0f%12.0f\n", nthreads, ops,
+                   ops / 1e3 / mm_secs, ops / 1e3 / libc_secs);
+        else
+            printf("%8d%10.0f%12s%12.0f\n", nthreads, ops,
+                   "--", ops / 1e3 / libc_secs);
+        if (nthreads >= max_threads)
+            break;
+    }
+    printf("\n");
+}
+
+/*
+ * load_variant - load the allocator built as the shared object path,
+ *     which must export mm_init, mm_malloc, mm_free and mm_realloc
+ */
+static void load_variant(variant_t *v, const char *path)
+{
+    v->path = path;
+    /* dlopen searches the library path for a name without a slash */
+    if (strchr(path, '/') == NULL) {
+        char *rel = malloc(strlen(path) + 3);
+        if (rel == NULL)
+            unix_error("malloc error in load_variant");
+        sprintf(rel, "./%s", path);
+        path = rel;
+    }
+    if ((v->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL)
+        app_error("can't load %s: %s", v->path, dlerror());
+    if ((v->init = (int (*)(void))dlsym(v->handle, "mm_init")) == NULL ||
+        (v->malloc = (void *(*)(size_t))dlsym(v->handle, "mm_malloc")) == NULL ||
+        (v->free = (void (*)(void *))dlsym(v->handle, "mm_free")) == NULL ||
+        (v->realloc = (void *(*)(void *, size_t))dlsym(v->handle, "mm_realloc")) == NULL)
+        app_error("%s doesn't export the mm.h functions: %s", v->path, dlerror());
+}
+
+/*
+ * eval_variant_util - eval_mm_util with the allocator of variant v
+ */
+static double eval_variant_util(trace_t *trace, const variant_t *v)
+{
+    int i, index;
+    size_t total_size = 0, max_total_size = 0;
+    char *p;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (v->init() < 0)
+        app_error("%s: mm_init failed in eval_variant_util", v->path);
+
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+        case ALLOC_BATCH:
+        case ALLOC_NEXT:
+            if ((p = v->malloc(trace->ops[i].size)) == NULL)
+                app_error("%s: mm_malloc failed in eval_variant_util", v->path);
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = trace->ops[i].size;
+            total_size += trace->ops[i].size;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = v->realloc(trace->blocks[index], trace->ops[i].size);
+            if (p == NULL && trace->ops[i].size != 0)
+                app_error("%s: mm_realloc failed in eval_variant_util", v->path);
+            total_size += trace->ops[i].size - trace->block_sizes[index];
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = trace->ops[i].size;
+            break;
+
+        case FREE: /* mm_free */
+        case FREE_BATCH:
+        case FREE_NEXT:
+            if (index < 0) {
+                v->free(NULL);
+                break;
+            }
+            v->free(trace->blocks[index]);
+            total_size -= trace->block_sizes[index];
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_variant_util");
+        }
+        if (total_size > max_total_size)
+            max_total_size = total_size;
+    }
+
+    return (double)max_total_size / (double)mem_peak_heapsize();
+}
+
+/*
+ * eval_variant_speed - eval_mm_speed with the allocator of a variant,
+ *     timed by fsecs
+ */
+static void eval_variant_speed(void *ptr)
+{
+    trace_t *trace = ((variant_speed_t *)ptr)->trace;
+    const variant_t *v = ((variant_speed_t *)ptr)->variant;
+    int i, index;
+    char *p;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (v->init() < 0)
+        app_error("%s: mm_init failed in eval_variant_speed", v->path);
+
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+        case ALLOC_BATCH:
+        case ALLOC_NEXT:
+            if ((p = v->malloc(trace->ops[i].size)) == NULL)
+                app_error("%s: mm_malloc error in eval_variant_speed", v->path);
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = v->realloc(trace->blocks[index], trace->ops[i].size);
+            if (p == NULL && trace->ops[i].size != 0)
+                app_error("%s: mm_realloc error in eval_variant_speed", v->path);
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+        case FREE_BATCH:
+        case FREE_NEXT:
+            v->free(index < 0 ? NULL : trace->blocks[index]);
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_variant_speed");
+        }
+    }
+}
+
+/*
+ * diff_interval - mean and half width of the 95% confidence interval of
+ *     the n paired differences d, by Student's t distribution
+ */
+static void diff_interval(const double *d, int n, double *mean, double *half)
+{
+    static const double t95[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    double sum = 0, var = 0;
+    int i, df = n - 1;
+
+    for (i = 0; i < n; i++)
+        sum += d[i];
+    *mean = sum / n;
+    for (i = 0; i < n; i++)
+        var += (d[i] - *mean) * (d[i] - *mean);
+    var /= df;
+    *half = (df <= (int)(sizeof(t95) / sizeof(t95[0])) ? t95[df - 1] : 1.960)
+            * sqrt(var / n);
+}
+
+/*
+ * print_diff - print the row of one trace, or of all, for the times
+ *     secs[0] and secs[1] of the variants in diff_rounds rounds, and
+ *     return whether B is significantly slower or uses less space
+ */
+static int print_diff(const char *name, double ops, const double *util,
+                      double *const secs[2])
+{
+    double d[diff_rounds], kops[2] = {0, 0};
+    double mean, half;
+    const char *flag = "";
+    int r, k, worse = 0;
+
+    for (r = 0; r < diff_rounds; r++) {
+        for (k = 0; k < 2; k++)
+            kops[k] += ops / 1e3 / secs[k][r] / diff_rounds;
+        /* relative change of the throughput of B in this round */
+        d[r] = secs[0][r] / secs[1][r] - 1;
+    }
+    diff_interval(d, diff_rounds, &mean, &half);
+
+    if (util != NULL) {
+        printf("%6.1f%%%7.1f%%%+7.1f", util[0] * 100, util[1] * 100,
+               (util[1] - util[0]) * 100);
+        /* replaying a trace always takes the same space */
+        if (util[1] < util[0])
+            worse = 1;
+    } else {
+        printf("%7s%8s%7s", "", "", "");
+    }
+    printf("%9.0f%9.0f%+7.1f%% [%+5.1f%%,%+5.1f%%]", kops[0], kops[1],
+           mean * 100, (mean - half) * 100, (mean + half) * 100);
+    if (mean + half < 0)
+        worse = 1;
+    else if (mean - half > 0)
+        flag = "  faster";
+    if (worse)
+        flag = "  REGRESSION";
+    printf("%s %s\n", flag, name);
+    return worse;
+}
+
+/*
+ * run_diff_tests - replay every trace with the two allocators in
+ *     diff_files in diff_rounds rounds, alternating which one goes first,
+ *     and compare B with A: the utilization, which doesn't change from
+ *     round to round, and the throughput of the paired rounds. A round
+ *     that fsecs gives no positive time for is timed again, and a trace
+ *     with a round that stays unusable is left out of the throughput
+ */
+static void run_diff_tests(int num_tracefiles, const char *tracedir,
+                           char **tracefiles)
+{
+    variant_t variants[2];
+    variant_speed_t params;
+    stats_t stats;
+    trace_t *trace;
+    double util[2], ops = 0;
+    double *secs[2], *total[2];
+    char *b;
+    int i, r, k, tries, usable, regressions = 0;
+
+    if ((b = strchr(diff_files, ',')) == NULL)
+        app_error("-X needs two shared objects, a.so,b.so");
+    *b++ = '\0';
+    load_variant(&variants[0], diff_files);
+    load_variant(&variants[1], b);
+
+    for (k = 0; k < 2; k++) {
+        secs[k] = malloc(diff_rounds * sizeof(double));
+        total[k] = calloc(diff_rounds, sizeof(double));
+        if (secs[k] == NULL || total[k] == NULL)
+            unix_error("malloc error in run_diff_tests");
+    }
+
+    printf("\nA = %s, B = %s, %d rounds, 95%% confidence intervals of B/A - 1:\n",
+           variants[0].path, variants[1].path, diff_rounds);
+    printf("%7s%8s%7s%9s%9s%8s %15s\n", "util A", "util B", "delta",
+           "Kops A", "Kops B", "delta", "interval");
+
+    for (i = 0; i < num_tracefiles; i++) {
+        mem_init();
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        params.trace = trace;
+        for (k = 0; k < 2; k++)
+            util[k] = eval_variant_util(trace, &variants[k]);
+        usable = 1;
+        for (r = 0; r < diff_rounds && usable; r++) {
+            for (k = 0; k < 2 && usable; k++) {
+                /* alternate the order, so a drift of the machine is shared */
+                int which = (r & 1) ? 1 - k : k;
+                params.variant = &variants[which];
+                secs[which][r] = 0;
+                for (tries = 0; tries < DIFF_TRIES && secs[which][r] <= 0; tries++)
+                    secs[which][r] = fsecs(eval_variant_speed, &params);
+                usable = secs[which][r] > 0;
+            }
+        }
+        if (!usable) {
+            /* still a regression of the space, that needs no time */
+            printf("%6.1f%%%7.1f%%%+7.1f%42s%s %s\n", util[0] * 100, util[1] * 100,
+                   (util[1] - util[0]) * 100, "no usable time",
+                   (util[1] < util[0]) ? "  REGRESSION" : "", trace->filename);
+            regressions += util[1] < util[0];
+            free_trace(trace);
+            mem_deinit();
+            continue;
+        }
+        for (r = 0; r < diff_rounds; r++)
+            for (k = 0; k < 2; k++)
+                total[k][r] += secs[k][r];
+        regressions += print_diff(trace->filename, trace->num_ops, util, secs);
+        ops += trace->num_ops;
+        free_trace(trace);
+        mem_deinit();
+    }
+    if (ops > 0)
+        print_diff("all traces", ops, NULL, total);
+
+    if (regressions > 0)
+        printf("%d significant regressions of B\n", regressions);
+    else
+        printf("No significant regressions of B\n");
+
+    for (k = 0; k < 2; k++) {
+        free(secs[k]);
+        free(total[k]);
+        dlclose(variants[k].handle);
+    }
+}
+
+/*
+ * stream_fill - read the next chunk of ops of stream s into chunk c,
+ *     a chunk that is not full tells the end of the trace, which is
+ *     after the number of ops in the header, or at EOF without it
+ */
+static void stream_fill(stream_t *s, chunk_t *c)
+{
+    char line[MAXLINE];
+    char type;
+    int index, size, count, n;
+
+    if (s->binary) {
+        c->n = fread(c->ops, sizeof(traceop_t),
+                     (s->left >= 0 && s->left < STREAM_CHUNK) ? s->left : STREAM_CHUNK, s->file);
+        s->left -= (s->left >= 0) ? c->n : 0;
+        for (n = 0; n < c->n; n++, s->op_index++) {
+            if (!check_op(&c->ops[n], s->op_index ? &s->prev : NULL, s->num_ids))
+                app_error("%s: bad request %lld in binary trace", s->filename, s->op_index);
+            s->prev = c->ops[n];
+        }
+        return;
+    }
+    for (c->n = 0; c->n < STREAM_CHUNK && s->left != 0; ) {
+        /* a batch is replayed block by block, it may span chunks */
+        if (s->batch_left > 0) {
+            c->ops[c->n++] = s->batch;
+            s->batch.type = (s->batch.type == FREE_BATCH || s->batch.type == FREE_NEXT)
+                            ? FREE_NEXT : ALLOC_NEXT;
+            s->batch.index++;
+            s->batch_left--;
+            s->left -= (s->left > 0);
+            continue;
+        }
+        if (fgets(line, MAXLINE, s->file) == NULL)
+            break;
+        s->lineno++;
+        if ((n = sscanf(line, " %c %d %d %d", &type, &index, &count, &size)) < 1)
+            continue; /* blank line */
+        if (type == 'A' || type == 'F') {
+            if (n < 3 || count < 1 || (type == 'A' && (n < 4 || size < 0)))
+                app_error("%s:%lld: bogus batch", s->filename, s->lineno);
+            s->batch.type = (type == 'A') ? ALLOC_BATCH : FREE_BATCH;
+            s->batch.index = index;
+            s->batch.size = (type == 'A') ? size : 0;
+            s->batch_left = count;
+            continue;
+        }
+        size = count;
+        if (n > 3)
+            n = 3;
+        /* like read_trace, a missing size is the last one read */
+        if (n == 2 && type != 'f')
+            size = s->last_size;
+        if (n < 2 || (type != 'a' && type != 'r' && type != 'f') || (type != 'f' && size < 0))
+            app_error("%s:%lld: bogus request", s->filename, s->lineno);
+        if (type != 'f')
+            s->last_size = size;
+        c->ops[c->n].type = (type == 'a') ? ALLOC : (type == 'r') ? REALLOC : FREE;
+        c->ops[c->n].index = index;
+        c->ops[c->n].size = (type == 'f') ? 0 : size;
+        c->n++;
+        s->left -= (s->left > 0);
+    }
+}
+
+/*
+ * stream_reader - the reader thread of a streaming replay, it fills the
+ *     two chunks in turn, each one once the replay is done with it
+ */
+static void *stream_reader(void *arg)
+{
+    stream_t *s = (stream_t *)arg;
+    chunk_t *c;
+    int k, last = 0;
+
+    for (k = 0; !last; k ^= 1) {
+        c = &s->chunks[k];
+        pthread_mutex_lock(&s->lock);
+        while (c->full)
+            pthread_cond_wait(&s->cond, &s->lock);
+        pthread_mutex_unlock(&s->lock);
+
+        stream_fill(s, c);
+        last = c->n < STREAM_CHUNK;
+
+        pthread_mutex_lock(&s->lock);
+        c->full = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+/*
+ * live_find - the slot of id in map m, or the empty slot where it goes
+ */
+static live_t *live_find(livemap_t *m, int id)
+{
+    size_t i = ((unsigned)id * 2654435761u) & m->mask;
+
+    while (m->slots[i].used && m->slots[i].id != id)
+        i = (i + 1) & m->mask;
+    return &m->slots[i];
+}
+
+/*
+ * live_grow - make map m twice larger if it's half full
+ */
+static void live_grow(livemap_t *m)
+{
+    live_t *old = m->slots;
+    size_t n = m->mask + 1, i;
+
+    if (2 * (m->count + 1) <= n)
+        return;
+    if ((m->slots = calloc(2 * n, sizeof(live_t))) == NULL)
+        unix_error("calloc failed in live_grow");
+    m->mask = 2 * n - 1;
+    for (i = 0; i < n; i++)
+        if (old[i].used)
+            *live_find(m, old[i].id) = old[i];
+    free(old);
+}
+
+/*
+ * live_remove - remove the id in slot of map m, and move back the ids
+ *     after it, so that no probe sequence is broken
+ */
+static void live_remove(livemap_t *m, live_t *slot)
+{
+    size_t i = slot - m->slots, j = i, home;
+
+    for (;;) {
+        j = (j + 1) & m->mask;
+        if (!m->slots[j].used)
+            break;
+        home = ((unsigned)m->slots[j].id * 2654435761u) & m->mask;
+        /* slot j may move to i if its home is not in (i, j] */
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            m->slots[i] = m->slots[j];
+            i = j;
+        }
+    }
+    m->slots[i].used = 0;
+    m->count--;
+}
+
+/*
+ * stream_trace - replay the trace in filename with mm as it's read, for
+ *     traces too large to keep in memory. Print the throughput, without
+ *     the time waiting for the reader, and the utilization at the peak
+ *     like eval_mm_util does
+ */
+static void stream_trace(const char *filename)
+{
+    stream_t s;
+    livemap_t live;
+    pthread_t reader;
+    binheader_t header;
+    struct timespec start, end, wait_start, wait_end;
+    double secs, wait_secs = 0;
+    long long ops = 0, total_size = 0, max_total_size = 0;
+    chunk_t *c;
+    live_t *slot;
+    traceop_t *op;
+    char *p;
+    int k, i, last = 0, weight, num_ids, num_ops, ignore_ranges;
+
+    memset(&s, 0, sizeof(s));
+    s.filename = filename;
+    if ((s.file = fopen(filename, "r")) == NULL)
+        unix_error("Could not open %s in stream_trace", filename);
+    /* a binary trace by its header, or the header lines of a text one */
+    if (fread(&header, sizeof(header), 1, s.file) == 1 &&
+        memcmp(header.magic, BIN_MAGIC, sizeof(header.magic)) == 0) {
+        if (header.op_size != sizeof(traceop_t))
+            app_error("%s: binary trace of another driver", filename);
+        s.binary = 1;
+        s.num_ids = header.num_ids;
+        s.left = header.num_ops;
+    } else {
+        rewind(s.file);
+        if (fscanf(s.file, "%d %d %d %d", &weight, &num_ids, &num_ops, &ignore_ranges) != 4)
+            app_error("%s: bad trace header", filename);
+        s.lineno = HDRLINES;
+        s.left = num_ops;
+    }
+    /* a trace too long for the header may give no number of ops */
+    if (s.left <= 0)
+        s.left = -1;
+    for (k = 0; k < 2; k++)
+        if ((s.chunks[k].ops = malloc(STREAM_CHUNK * sizeof(traceop_t))) == NULL)
+            unix_error("malloc failed in stream_trace");
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    live.mask = 1023;
+    live.count = 0;
+    if ((live.slots = calloc(live.mask + 1, sizeof(live_t))) == NULL)
+        unix_error("calloc failed in stream_trace");
+
+    mem_init();
+    if (mm_init() < 0)
+        app_error("mm_init failed in stream_trace");
+    if (pthread_create(&reader, NULL, stream_reader, &s) != 0)
+        unix_error("pthread_create failed in stream_trace");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (k = 0; !last; k ^= 1) {
+        c = &s.chunks[k];
+        clock_gettime(CLOCK_MONOTONIC, &wait_start);
+        pthread_mutex_lock(&s.lock);
+        while (!c->full)
+            pthread_cond_wait(&s.cond, &s.lock);
+        pthread_mutex_unlock(&s.lock);
+        clock_gettime(CLOCK_MONOTONIC, &wait_end);
+        wait_secs += (wait_end.tv_sec - wait_start.tv_sec) +
+                     (wait_end.tv_nsec - wait_start.tv_nsec) / 1e9;
+
+        for (i = 0; i < c->n; i++) {
+            op = &c->ops[i];
+            if (op->type == FREE && op->index < 0) {
+                mm_free(NULL);
+                continue;
+            }
+            live_grow(&live);
+            slot = live_find(&live, op->index);
+            switch (op->type) {
+            case ALLOC:
+            case ALLOC_BATCH:
+            case ALLOC_NEXT:
+                if (slot->used)
+                    app_error("%s: op %lld allocates live id %d", filename, ops + i, op->index);
+                if ((p = mm_malloc(op->size)) == NULL)
+                    app_error("%s: mm_malloc failed at op %lld", filename, ops + i);
+                slot->used = 1;
+                slot->id = op->index;
+                slot->p = p;
+                slot->size = op->size;
+                live.count++;
+                total_size += op->size;
+                break;
+
+            case REALLOC:
+                p = mm_realloc(slot->used ? slot->p : NULL, op->size);
+                if (p == NULL && op->size != 0)
+                    app_error("%s: mm_realloc failed at op %lld", filename, ops + i);
+                total_size += (long long)op->size - (slot->used ? (long long)slot->size : 0);
+                if (!slot->used) {
+                    slot->used = 1;
+                    slot->id = op->index;
+                    live.count++;
+                }
+                slot->p = p;
+                slot->size = op->size;
+                if (p == NULL)
+                    live_remove(&live, slot);
+                break;
+
+            case FREE:
+            case FREE_BATCH:
+            case FREE_NEXT:
+                if (!slot->used)
+                    app_error("%s: op %lld frees id %d that is not live", filename, ops + i, op->index);
+                mm_free(slot->p);
+                total_size -= slot->size;
+                live_remove(&live, slot);
+                break;
+            }
+            if (total_size > max_total_size)
+                max_total_size = total_size;
+        }
+        ops += c->n;
+        last = c->n < STREAM_CHUNK;
+
+        pthread_mutex_lock(&s.lock);
+        c->full = 0;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_join(reader, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9 - wait_secs;
+    printf("\nStreaming replay of %s:\n", filename);
+    printf("%12s%10s%10s%8s%14s%12s%10s\n",
+           "ops", "secs", "Kops", "util", "peak heap", "live ids", "wait secs");
+    printf("%12lld%10.4f%10.0f%7.0f%%%14zu%12zu%10.4f\n", ops, secs,
+           (secs > 0) ? ops / 1e3 / secs : 0.0,
+           mem_peak_heapsize() ? 100.0 * max_total_size / mem_peak_heapsize() : 0.0,
+           mem_peak_heapsize(), live.count, wait_secs);
+
+    mem_deinit();
+    free(live.slots);
+    free(s.chunks[0].ops);
+    free(s.chunks[1].ops);
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.cond);
+    fclose(s.file);
+}
+
+/*
+ * lat_bucket - return the histogram bucket of a latency of v cycles
+ */
+static int lat_bucket(unsigned long long v)
+{
+    int shift;
+
+    if (v < LAT_SUB)
+        return (int)v;
+    shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS + 1;
+    return shift * (LAT_SUB / 2) + (int)(v >> shift);
+}
+
+/*
+ * lat_bucket_hi - return the largest latency that falls in bucket b
+ */
+static unsigned long long lat_bucket_hi(int b)
+{
+    int shift;
+
+    if (b < LAT_SUB)
+        return (unsigned long long)b;
+    shift = b / (LAT_SUB / 2) - 1;
+    return ((unsigned long long)(b - shift * (LAT_SUB / 2)) << shift)
+        + (1ULL << shift) - 1;
+}
+
+/*
+ * lat_class - return the size class of a request of size bytes
+ */
+static int lat_class(size_t size)
+{
+    int c = 0;
+
+    while (c < LAT_CLASSES - 1 && size > ((size_t)LAT_MIN_CLASS << (2 * c)))
+        c++;
+    return c;
+}
+
+/*
+ * lat_class_range - set lo and hi to the smallest and largest size of
+ *     class c, hi to 0 for the last class, which has no upper bound
+ */
+static void lat_class_range(int c, size_t *lo, size_t *hi)
+{
+    *lo = (c == 0) ? 0 : ((size_t)LAT_MIN_CLASS << (2 * c - 2)) + 1;
+    *hi = (c == LAT_CLASSES - 1) ? 0 : (size_t)LAT_MIN_CLASS << (2 * c);
+}
+
+/*
+ * lat_record - count a latency of cycles for a request of type op
+ *     and size bytes, less the overhead of reading the counter
+ */
+static void lat_record(int op, size_t size, unsigned long long cycles)
+{
+    lat_hist_t *h = &lat_trace[op][lat_class(size)];
+
+    cycles = (cycles > lat_ovhd) ? cycles - lat_ovhd : 0;
+    h->count++;
+    h->sum += cycles;
+    if (cycles > h->max)
+        h->max = cycles;
+    h->buckets[lat_bucket(cycles)]++;
+}
+
+/*
+ * lat_percentile - return the largest latency of the bucket that holds
+ *     the fraction q of the requests in h, at most the largest latency
+ */
+static unsigned long long lat_percentile(const lat_hist_t *h, double q)
+{
+    unsigned long long rank = (unsigned long long)(q * h->count), seen = 0;
+    int b;
+
+    if (rank >= h->count)
+        rank = h->count - 1;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank)
+            break;
+    }
+    return (lat_bucket_hi(b) < h->max) ? lat_bucket_hi(b) : h->max;
+}
+
+/*
+ * eval_mm_latency - replay a trace once, reading the cycle counter
+ *     around every request, and add the latencies to lat_trace
+ */
+static void eval_mm_latency(trace_t *trace)
+{
+    int i, index;
+    size_t size;
+    char *p;
+    unsigned long long start;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+        case ALLOC_BATCH:
+        case ALLOC_NEXT:
+            start = read_counter();
+            p = mm_malloc(size);
+            lat_record(ALLOC, size, read_counter() - start);
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            start = read_counter();
+            p = mm_realloc(trace->blocks[index], size);
+            lat_record(REALLOC, size, read_counter() - start);
+            if (p == NULL && size != 0)
+                app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+
+        case FREE: /* mm_free, by the size of the block */
+        case FREE_BATCH:
+        case FREE_NEXT:
+            p = (index < 0) ? NULL : trace->blocks[index];
+            size = (index < 0) ? 0 : trace->block_sizes[index];
+            start = read_counter();
+            mm_free(p);
+            lat_record(FREE, size, read_counter() - start);
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_latency");
+        }
+    }
+}
+
+/*
+ * lat_open - open the file of the latency histograms and measure the
+ *     overhead of reading the counter, the least of many back to back reads
+ */
+static void lat_open(const char *filename)
+{
+    const char *dot = strrchr(filename, '.');
+    unsigned long long start, cycles;
+    int i;
+
+    if ((lat_file = fopen(filename, "w")) == NULL)
+        unix_error("Could not open %s for the latency histograms", filename);
+    lat_json = dot != NULL && strcmp(dot, ".json") == 0;
+    if (lat_json)
+        fprintf(lat_file, "[");
+    else
+        fprintf(lat_file, "trace,op,min_size,max_size,count,mean,p50,p99,p99.9,max\n");
+
+    lat_ovhd = ~0ULL;
+    for (i = 0; i < 1000; i++) {
+        start = read_counter();
+        cycles = read_counter() - start;
+        if (cycles < lat_ovhd)
+            lat_ovhd = cycles;
+    }
+}
+
+/*
+ * lat_write - write a row for every op type and size class with
+ *     requests in hists, in cycles, and with total add them to lat_total
+ */
+static void lat_write(const char *tracename, lat_hist_t hists[][LAT_CLASSES], int total)
+{
+    static const char *names[] = { "malloc", "free", "realloc" };
+    static int rows = 0;
+    int op, c, b;
+    size_t lo, hi;
+    lat_hist_t *h;
+
+    for (op = 0; op < LAT_OPS; op++) {
+        for (c = 0; c < LAT_CLASSES; c++) {
+            h = &hists[op][c];
+            if (h->count == 0)
+                continue;
+            lat_class_range(c, &lo, &hi);
+            fprintf(lat_file, lat_json ?
+                    "%s\n  {\"trace\": \"%s\", \"op\": \"%s\", \"min_size\": %lu, "
+                    "\"max_size\": %lu, \"count\": %llu, \"mean\": %.1f, \"p50\": %llu, "
+                    "\"p99\": %llu, \"p99.9\": %llu, \"max\": %llu}" :
+                    "%s%s,%s,%lu,%lu,%llu,%.1f,%llu,%llu,%llu,%llu\n",
+                    (lat_json && rows++ > 0) ? "," : "",
+                    tracename, names[op], (unsigned long)lo, (unsigned long)hi, h->count,
+                    (double)h->sum / h->count, lat_percentile(h, 0.5),
+                    lat_percentile(h, 0.99), lat_percentile(h, 0.999), h->max);
+            if (total)
+                continue;
+            lat_total[op][c].count += h->count;
+            lat_total[op][c].sum += h->sum;
+            if (h->max > lat_total[op][c].max)
+                lat_total[op][c].max = h->max;
+            for (b = 0; b < LAT_BUCKETS; b++)
+                lat_total[op][c].buckets[b] += h->buckets[b];
+        }
+    }
+    if (!total)
+        memset(hists, 0, sizeof(lat_trace));
+}
+
+/*
+ * lat_close - write the rows of all traces together, print them,
+ *     and close the file of the latency histograms
+ */
+static void lat_close(void)
+{
+    static const char *names[] = { "malloc", "free", "realloc" };
+    int op, c;
+    size_t lo, hi;
+    char range[64];
+    lat_hist_t *h;
+
+    lat_write("total", lat_total, 1);
+    if (lat_json)
+        fprintf(lat_file, "\n]\n");
+    fclose(lat_file);
+
+    if (!verbose)
+        return;
+    printf("Latency in cycles for mm malloc:\n");
+    printf("%8s %14s %10s %8s %8s %8s %10s\n",
+           "op", "size", "count", "p50", "p99", "p99.9", "max");
+    for (op = 0; op < LAT_OPS; op++) {
+        for (c = 0; c < LAT_CLASSES; c++) {
+            h = &lat_total[op][c];
+            if (h->count == 0)
+                continue;
+            lat_class_range(c, &lo, &hi);
+            if (hi == 0)
+                sprintf(range, "%lu-", (unsigned long)lo);
+            else
+                sprintf(range, "%lu-%lu", (unsigned long)lo, (unsigned long)hi);
+            printf("%8s %14s %10llu %8llu %8llu %8llu %10llu\n", names[op], range,
+                   h->count, lat_percentile(h, 0.5), lat_percentile(h, 0.99),
+                   lat_percentile(h, 0.999), h->max);
+        }
+    }
+    printf("\n");
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1172,6 +3173,8 @@ static int eval_libc_valid(trace_t *trace)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* malloc */
+        case ALLOC_BATCH:
+        case ALLOC_NEXT:
             if ((p = malloc(trace->ops[i].size)) == NULL) {
                 malloc_error(trace, i, "libc malloc failed");
                 unix_error("System message");
@@ -1190,6 +3193,8 @@ static int eval_libc_valid(trace_t *trace)
             break;
 
         case FREE: /* free */
+        case FREE_BATCH:
+        case FREE_NEXT:
             if(trace->ops[i].index >= 0) {
                 free(trace->blocks[trace->ops[i].index]);
             } else {
@@ -1222,6 +3227,8 @@ static void eval_libc_speed(void *ptr)
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
+        case ALLOC_BATCH:
+        case ALLOC_NEXT:
             index = trace->ops[i].index;
             size = trace->ops[i].size;
             if ((p = malloc(size)) == NULL)
@@ -1240,6 +3247,8 @@ static void eval_libc_speed(void *ptr)
             break;
 
         case FREE: /* free */
+        case FREE_BATCH:
+        case FREE_NEXT:
             index = trace->ops[i].index;
             if(index >= 0) {
                 block = trace->blocks[index];
@@ -1271,12 +3280,20 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     double sumutil = 0;
     int sum_perf_weight = 0;
     int sum_util_weight = 0;
+    double sumcounters[PERF_NUM] = {0};
+    char name[16];
+    int k;
 
     char wstr;
 
     /* Print the individual results for each trace */
-    printf("  %2s%6s %5s%8s%9s  %s\n",
-           "valid", "util", "ops", "secs", "Kops", "trace");
+    printf("  %2s%6s %5s%8s%9s ",
+           "valid", "util", "ops", "secs", "Kops");
+    for (k = 0; perf_counters && k < PERF_NUM; k++) {
+        sprintf(name, "%s/op", perf_names[k]);
+        printf("%9s", name);
+    }
+    printf(" %s\n", "trace");
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
             switch(stats[i].weight)
@@ -1318,6 +3335,14 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
             else
                 printf("%8s%10s%6s", "--", "--", "--");
 
+            /* counts per op, '-' if the counter is not available */
+            for (k = 0; perf_counters && k < PERF_NUM; k++) {
+                if (stats[i].counters[k] < 0)
+                    printf("%9s", "-");
+                else
+                    printf("%9.1f", stats[i].counters[k] / stats[i].ops);
+            }
+
             printf(" %s\n", stats[i].filename);
 
             if(stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1325,6 +3350,9 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     sum_perf_weight += 1;
                     sumsecs += stats[i].secs;
                     sumops += stats[i].ops;
+                    for (k = 0; k < PERF_NUM; k++)
+                        sumcounters[k] = (sumcounters[k] < 0 || stats[i].counters[k] < 0) ?
+                            -1 : sumcounters[k] + stats[i].counters[k];
                 }
             if(stats[i].weight == WALL || stats[i].weight == WUTIL)
                 {
@@ -1333,14 +3361,16 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                 }
         }
         else {
-            printf("%2s%4s %6s%8s%10s%6s %s\n",
+            printf("%2s%4s %6s%8s%10s%6s",
                    stats[i].weight != 0 ? "*" : "",
                    "no",
                    "-",
                    "-",
                    "-",
-                   "-",
-                   stats[i].filename);
+                   "-");
+            for (k = 0; perf_counters && k < PERF_NUM; k++)
+                printf("%9s", "-");
+            printf(" %s\n", stats[i].filename);
         }
     }
 
@@ -1353,13 +3383,20 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
 
         double util = (sumutil/(double)sum_util_weight)*100.0;
         double tput = (sumsecs==0.0) ? 0 : (sumops/1e3)/sumsecs;
-        printf("%2d %2d  %5.0f%%%8.0f%10.6f%6.0f\n",
+        printf("%2d %2d  %5.0f%%%8.0f%10.6f%6.0f",
                sum_util_weight,
                sum_perf_weight,
                util,
                sumops,
                sumsecs,
                tput);
+        for (k = 0; perf_counters && k < PERF_NUM; k++) {
+            if (sumcounters[k] < 0 || sumops == 0)
+                printf("%9s", "-");
+            else
+                printf("%9.1f", sumcounters[k] / sumops);
+        }
+        printf("\n");
 
         /* Record the summary statistics so we can compare libc and
            mm.cc */
@@ -1423,12 +3460,52 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     va_end(ap);
 }
 
+/*
+ * print_mm_stats - print the counters of the mm package after the
+ *     last replay of a trace, and the classes that have any blocks
+ */
+static void print_mm_stats(const char *tracename)
+{
+    mm_stats_t st;
+    size_t reallocs;
+    char range[64];
+    int c;
+
+    mm_stats(&st);
+    reallocs = st.realloc_in_place + st.realloc_copies;
+    printf("Counters of mm malloc after %s:\n", tracename);
+    printf("  in use %lu, free %lu, heap %lu bytes (%.0f%% in use)\n",
+           (unsigned long)st.in_use, (unsigned long)st.free_bytes,
+           (unsigned long)st.heap_size,
+           st.heap_size ? 100.0 * st.in_use / st.heap_size : 0.0);
+    printf("  %lu splits, %lu coalesces, %lu extends, %lu trims, %lu maps, %lu unmaps\n",
+           (unsigned long)st.splits, (unsigned long)st.coalesces,
+           (unsigned long)st.extends, (unsigned long)st.trims,
+           (unsigned long)st.maps, (unsigned long)st.unmaps);
+    printf("  %lu reallocs in place, %lu copied (%.0f%% in place)\n",
+           (unsigned long)st.realloc_in_place, (unsigned long)st.realloc_copies,
+           reallocs ? 100.0 * st.realloc_in_place / reallocs : 0.0);
+    printf("  %lu fits from the recent block of a list\n", (unsigned long)st.recent_hits);
+    printf("  %14s %10s %10s %12s\n", "size", "mallocs", "frees", "free blocks");
+    for (c = 0; c < MM_STATS_CLASSES; c++) {
+        if (st.mallocs[c] == 0 && st.frees[c] == 0 && st.free_blocks[c] == 0)
+            continue;
+        if (c == MM_STATS_CLASSES - 1)
+            sprintf(range, "%lu-", 1UL << c);
+        else
+            sprintf(range, "%lu-%lu", 1UL << c, (2UL << c) - 1);
+        printf("  %14s %10lu %10lu %12lu\n", range, (unsigned long)st.mallocs[c],
+               (unsigned long)st.frees[c], (unsigned long)st.free_blocks[c]);
+    }
+    printf("\n");
+}
+
 /*
  * usage - Explain the command line arguments
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-hlVdDSBmCI] [-f <file>] [-T <n>] [-R <file>] [-H <file>] [-P <dir>] [-j <n>]\n\t[-X <a.so,b.so>] [-N <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-p         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
@@ -1441,4 +3518,16 @@ static void usage(void)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-T <n>     Replay on 1, 2, 4, ... n threads, and report Kops of mm and libc.\n");
+    fprintf(stderr, "\t-S         With -T, split the ids of a trace across threads instead of copying it.\n");
+    fprintf(stderr, "\t-R <file>  Replay <file> as it's read, for traces too large for memory.\n");
+    fprintf(stderr, "\t-P <dir>   Write a snapshot of the heap at the peak of each trace to <dir>, and print its free blocks.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate up to n traces at once, each in a worker process pinned to a core.\n");
+    fprintf(stderr, "\t-I         With -j, take the speed measurements of the workers one at a time.\n");
+    fprintf(stderr, "\t-X <a.so,b.so>  Compare the throughput and utilization of two allocator builds.\n");
+    fprintf(stderr, "\t-N <n>     With -X, replay each trace in n rounds (default 10).\n");
+    fprintf(stderr, "\t-C         Count instructions, cache, TLB and branch misses and page faults per op.\n");
+    fprintf(stderr, "\t-m         Print the counters of mm_stats after each trace.\n");
+    fprintf(stderr, "\t-H <file>  Time every request and write latency histograms to <file>, JSON if it ends in .json, else CSV.\n");
+    fprintf(stderr, "\t-B         Write a binary trace (.bin) next to every trace, which is then mapped instead of parsed.\n");
 }
@@ -12,6 +12,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
 
 #include "memlib.h"
 #include "config.h"
@@ -20,6 +23,23 @@
 static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
+static char *fresh_brk;				/* bytes from here on have never been given */
+static unsigned char owners[MAX_HEAP / MEM_CHUNKSIZE + 1]; /* owner of every chunk */
+static int last_owner = -1;			/* owner of the chunk at the brk */
+static size_t peak_size;			/* high water mark of brk heap and mapped bytes */
+static size_t mapped_size;			/* bytes in regions from mem_map */
+
+/* a region given by mem_map, outside the brk heap */
+typedef struct mem_region {
+	char *lo;
+	size_t size;
+	struct mem_region *next;
+} mem_region_t;
+static mem_region_t *regions;
+#ifdef MM_THREADS
+/* the brk may be moved by many threads at the same time */
+static pthread_mutex_t brk_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 /* 
  * mem_init - initialize the memory system model
@@ -29,47 +49,241 @@ void mem_init(void){
 	heap = mmap((void *)0x800000000, /* suggested start*/
 			MAX_HEAP,				/* length */
 			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
+			MAP_PRIVATE | MAP_NORESERVE,	/* private, only touched pages count */
 			dev_zero,				/* fd */
 			0);						/* offset (dunno) */
 	mem_max_addr = heap + MAX_HEAP;
 	mem_brk = heap;					/* heap is empty initially */
+	fresh_brk = heap;
+}
+
+/*
+ * unmap_all - give back every region from mem_map
+ */
+static void unmap_all(void){
+	mem_region_t *r;
+
+	while ((r = regions) != NULL) {
+		regions = r->next;
+		munmap(r->lo, r->size);
+		free(r);
+	}
+	mapped_size = 0;
 }
 
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
+	unmap_all();
 	munmap(heap, MAX_HEAP);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *		and unmap the regions left from the last run
  */
 void mem_reset_brk(){
+	unmap_all();
 	mem_brk = heap;
+	last_owner = -1;
+	peak_size = 0;
 }
 
-/* 
- * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+/*
+ * update_peak - record the high water mark, the caller holds the lock
+ */
+static void update_peak(void){
+	size_t size = (size_t)(mem_brk - heap) + mapped_size;
+
+	if (size > peak_size)
+		peak_size = size;
+}
+
+/*
+ * grow_brk - move the brk by incr bytes, the caller holds the lock
+ *		the new area is zero like the pages sbrk gets from the kernel,
+ *		the bytes given before, and shrunk or reset since, are cleared
  */
-void *mem_sbrk(int incr) {
+static void *grow_brk(intptr_t incr) {
 	char *old_brk = mem_brk;
 
     // call sbrk() in an attempt to have similar semantics as a real allocator.
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ||
-            sbrk(incr) == (void *) -1) {
+    // but never shrink the real brk, libc malloc may have grown it since.
+	if ( ((mem_brk + incr) < heap) || ((mem_brk + incr) > mem_max_addr) ||
+            (incr > 0 && sbrk(incr) == (void *) -1)) {
 		errno = ENOMEM;
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 		return (void *)-1;
 	}
 
+	if (incr > 0 && mem_brk < fresh_brk)
+		memset(mem_brk, 0, (fresh_brk - mem_brk < incr) ? (size_t)(fresh_brk - mem_brk) : (size_t)incr);
 	mem_brk += incr;
+	if (mem_brk > fresh_brk)
+		fresh_brk = mem_brk;
+	update_peak();
+	return (void *)old_brk;
+}
+
+/* 
+ * mem_sbrk - simple model of the sbrk function. Extends the heap 
+ *		by incr bytes and returns the start address of the new area,
+ *		which is zero filled. A negative incr shrinks the heap. With MM_THREADS, the brk is moved
+ *		under a lock so that the areas never overlap.
+ */
+void *mem_sbrk(intptr_t incr) {
+	char *old_brk;
+
+#ifdef MM_THREADS
+	pthread_mutex_lock(&brk_lock);
+#endif
+	old_brk = grow_brk(incr);
+	last_owner = -1;
+#ifdef MM_THREADS
+	pthread_mutex_unlock(&brk_lock);
+#endif
+	return (void *)old_brk;
+}
+
+/*
+ * mem_sbrk_owner - like mem_sbrk, but the new area belongs to owner, and
+ *		mem_owner tells who a pointer belongs to. The area is right after
+ *		the last one if that has the same owner, otherwise it starts at a
+ *		new chunk of MEM_CHUNKSIZE bytes, so that no chunk is shared.
+ *		A negative incr shrinks the heap only if the last area is owner's.
+ */
+void *mem_sbrk_owner(intptr_t incr, int owner) {
+	char *old_brk;
+	size_t pad = 0;
+
+#ifdef MM_THREADS
+	pthread_mutex_lock(&brk_lock);
+#endif
+	if (incr < 0 && owner != last_owner) {
+#ifdef MM_THREADS
+		pthread_mutex_unlock(&brk_lock);
+#endif
+		return (void *)-1;
+	}
+	if (owner != last_owner)
+		pad = (MEM_CHUNKSIZE - (mem_brk - heap) % MEM_CHUNKSIZE) % MEM_CHUNKSIZE;
+	if ((pad && grow_brk(pad) == (void *)-1) ||
+			(old_brk = grow_brk(incr)) == (void *)-1) {
+#ifdef MM_THREADS
+		pthread_mutex_unlock(&brk_lock);
+#endif
+		return (void *)-1;
+	}
+	for (size_t i = (old_brk - heap) / MEM_CHUNKSIZE; i * MEM_CHUNKSIZE < (size_t)(mem_brk - heap); ++i)
+		owners[i] = (unsigned char)owner;
+	last_owner = owner;
+#ifdef MM_THREADS
+	pthread_mutex_unlock(&brk_lock);
+#endif
 	return (void *)old_brk;
 }
 
+/*
+ * mem_owner - return the owner recorded for the chunk of p
+ */
+int mem_owner(const void *p) {
+	return owners[((const char *)p - heap) / MEM_CHUNKSIZE];
+}
+
+/*
+ * mem_map - map a region of size bytes, a multiple of the page size,
+ *		outside the brk heap, like mmap. Return (void *)-1 if failed.
+ */
+void *mem_map(size_t size) {
+	mem_region_t *r;
+	char *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return (void *)-1;
+	if ((r = malloc(sizeof(mem_region_t))) == NULL) {
+		munmap(p, size);
+		return (void *)-1;
+	}
+	r->lo = p;
+	r->size = size;
+#ifdef MM_THREADS
+	pthread_mutex_lock(&brk_lock);
+#endif
+	r->next = regions;
+	regions = r;
+	mapped_size += size;
+	update_peak();
+#ifdef MM_THREADS
+	pthread_mutex_unlock(&brk_lock);
+#endif
+	return (void *)p;
+}
+
+/*
+ * mem_unmap - unmap the region at p from mem_map
+ */
+void mem_unmap(void *p) {
+	mem_region_t **rp, *r = NULL;
+
+#ifdef MM_THREADS
+	pthread_mutex_lock(&brk_lock);
+#endif
+	for (rp = &regions; *rp != NULL; rp = &(*rp)->next) {
+		if ((*rp)->lo == p) {
+			r = *rp;
+			*rp = r->next;
+			mapped_size -= r->size;
+			break;
+		}
+	}
+#ifdef MM_THREADS
+	pthread_mutex_unlock(&brk_lock);
+#endif
+	if (r != NULL) {
+		munmap(r->lo, r->size);
+		free(r);
+	}
+}
+
+/*
+ * mem_is_mapped - return whether p is outside the brk heap, i.e. in
+ *		a region from mem_map if it's a valid pointer
+ */
+int mem_is_mapped(const void *p) {
+	return (const char *)p < heap || (const char *)p >= mem_max_addr;
+}
+
+/*
+ * mem_in_heap - return whether bytes lo to hi lie in the brk heap
+ *		or in one region from mem_map
+ */
+int mem_in_heap(const void *lo, const void *hi) {
+	mem_region_t *r;
+	int found = 0;
+
+	if ((const char *)lo >= heap && (const char *)hi < mem_brk)
+		return 1;
+#ifdef MM_THREADS
+	pthread_mutex_lock(&brk_lock);
+#endif
+	for (r = regions; r != NULL && !found; r = r->next)
+		found = (const char *)lo >= r->lo && (const char *)hi < r->lo + r->size;
+#ifdef MM_THREADS
+	pthread_mutex_unlock(&brk_lock);
+#endif
+	return found;
+}
+
+/*
+ * mem_peak_heapsize - returns the high water mark of the heap size plus
+ *		the mapped bytes since the last reset
+ */
+size_t mem_peak_heapsize(void) {
+	return peak_size;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
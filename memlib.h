@@ -1,11 +1,22 @@
 #include <unistd.h>
+#include <stdint.h>
+
+/* granularity of the owners recorded by mem_sbrk_owner */
+#define MEM_CHUNKSIZE (1 << 12)
 
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
+void *mem_sbrk_owner(intptr_t incr, int owner);
+int mem_owner(const void *p);
+void *mem_map(size_t size);
+void mem_unmap(void *p);
+int mem_is_mapped(const void *p);
+int mem_in_heap(const void *lo, const void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
 
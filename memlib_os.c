@@ -0,0 +1,308 @@
+/*
+ * memlib_os.c - the memory system of a real process, for libmm.so
+ *		The same interface as memlib.c, but nothing is simulated:
+ *		the brk heap is a reservation of MEM_RESERVE bytes of address
+ *		space without access, made on first use, and the pages of it
+ *		below the brk are made accessible as the heap grows, so the
+ *		heap stays contiguous as mm.c needs. A region of mem_map is a
+ *		mapping of its own, with its size in the page before it.
+ *		No call here may use malloc, which may be mm.c itself.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
+
+#include "memlib.h"
+
+/*
+ * Address space reserved for the brk heap. The offsets of the default
+ * layout of mm.c are 32 bits, so its heap can't be larger than 4GB
+ */
+#ifndef MEM_RESERVE
+#ifdef MM_WIDE
+#define MEM_RESERVE (1UL << 40)
+#else
+#define MEM_RESERVE (1UL << 32)
+#endif
+#endif
+
+/* The brk heap is made accessible in steps of this many bytes */
+#define MEM_COMMIT (1UL << 20)
+
+/* private variables */
+static char *heap;					/* NULL until the first use */
+static char *mem_brk;
+static char *mem_max_addr;
+static char *committed;				/* accessible bytes end here */
+static unsigned char *owners;		/* owner of every chunk, mapped too */
+static int last_owner = -1;			/* owner of the chunk at the brk */
+static size_t peak_size;			/* high water mark of brk heap and mapped bytes */
+static size_t mapped_size;			/* bytes in regions from mem_map */
+#ifdef MM_THREADS
+static pthread_mutex_t brk_lock = PTHREAD_MUTEX_INITIALIZER;
+#define BRK_LOCK() pthread_mutex_lock(&brk_lock)
+#define BRK_UNLOCK() pthread_mutex_unlock(&brk_lock)
+#else
+#define BRK_LOCK()
+#define BRK_UNLOCK()
+#endif
+
+/*
+ * reserve - reserve the address space of the heap and the table of
+ *		owners, the caller holds the lock. Return 0 if failed
+ */
+static int reserve(void) {
+	char *p;
+
+	if (heap != NULL)
+		return 1;
+	p = mmap(NULL, MEM_RESERVE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return 0;
+	owners = mmap(NULL, MEM_RESERVE / MEM_CHUNKSIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (owners == MAP_FAILED) {
+		munmap(p, MEM_RESERVE);
+		return 0;
+	}
+	mem_max_addr = p + MEM_RESERVE;
+	mem_brk = committed = p;
+	heap = p;
+	return 1;
+}
+
+/*
+ * mem_init - reserve the heap, which is done on first use anyway
+ */
+void mem_init(void){
+	BRK_LOCK();
+	reserve();
+	BRK_UNLOCK();
+}
+
+/*
+ * mem_deinit - give back the heap, the regions of mem_map are left
+ *		to their owners
+ */
+void mem_deinit(void){
+	BRK_LOCK();
+	if (heap != NULL) {
+		munmap(heap, MEM_RESERVE);
+		munmap(owners, MEM_RESERVE / MEM_CHUNKSIZE);
+		heap = NULL;
+	}
+	BRK_UNLOCK();
+}
+
+/*
+ * drop - give the pages of the heap from lo to hi back to the kernel,
+ *		so that they read as zero when they are given again. The bytes
+ *		of the page of lo are cleared by hand
+ */
+static void drop(char *lo, char *hi) {
+	size_t page = (size_t)getpagesize();
+	char *up = (char *)(((uintptr_t)lo + page - 1) & ~(uintptr_t)(page - 1));
+
+	if (up > hi)
+		up = hi;
+	memset(lo, 0, up - lo);
+	if (up < hi)
+		madvise(up, hi - up, MADV_DONTNEED);
+}
+
+/*
+ * mem_reset_brk - make an empty heap
+ */
+void mem_reset_brk(){
+	BRK_LOCK();
+	if (heap != NULL && mem_brk > heap)
+		drop(heap, mem_brk);
+	mem_brk = heap;
+	last_owner = -1;
+	peak_size = mapped_size;
+	BRK_UNLOCK();
+}
+
+/*
+ * update_peak - record the high water mark, the caller holds the lock
+ */
+static void update_peak(void){
+	size_t size = (size_t)(mem_brk - heap) + mapped_size;
+
+	if (size > peak_size)
+		peak_size = size;
+}
+
+/*
+ * grow_brk - move the brk by incr bytes, the caller holds the lock
+ *		the new area is zero, the pages beyond the brk are made
+ *		accessible as needed, and the ones given back are dropped
+ */
+static void *grow_brk(intptr_t incr) {
+	char *old_brk, *top;
+
+	if (!reserve() || (mem_brk + incr) < heap || (mem_brk + incr) > mem_max_addr) {
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+	old_brk = mem_brk;
+	if (mem_brk + incr > committed) {
+		top = heap + ((mem_brk + incr - heap + MEM_COMMIT - 1) & ~(MEM_COMMIT - 1));
+		if (top > mem_max_addr)
+			top = mem_max_addr;
+		if (mprotect(committed, top - committed, PROT_READ | PROT_WRITE) != 0) {
+			errno = ENOMEM;
+			return (void *)-1;
+		}
+		committed = top;
+	}
+	if (incr < 0)
+		drop(mem_brk + incr, mem_brk);
+	mem_brk += incr;
+	update_peak();
+	return (void *)old_brk;
+}
+
+/*
+ * mem_sbrk - extend the heap by incr bytes and return the start address
+ *		of the new area, which is zero filled. A negative incr shrinks
+ *		the heap
+ */
+void *mem_sbrk(intptr_t incr) {
+	char *old_brk;
+
+	BRK_LOCK();
+	old_brk = grow_brk(incr);
+	last_owner = -1;
+	BRK_UNLOCK();
+	return (void *)old_brk;
+}
+
+/*
+ * mem_sbrk_owner - like mem_sbrk, but the new area belongs to owner, as
+ *		in memlib.c: it starts at a new chunk of MEM_CHUNKSIZE bytes
+ *		unless the last area is owner's, and only owner may shrink it
+ */
+void *mem_sbrk_owner(intptr_t incr, int owner) {
+	char *old_brk;
+	size_t pad = 0;
+
+	BRK_LOCK();
+	if (!reserve() || (incr < 0 && owner != last_owner)) {
+		BRK_UNLOCK();
+		return (void *)-1;
+	}
+	if (owner != last_owner)
+		pad = (MEM_CHUNKSIZE - (mem_brk - heap) % MEM_CHUNKSIZE) % MEM_CHUNKSIZE;
+	if ((pad && grow_brk(pad) == (void *)-1) ||
+			(old_brk = grow_brk(incr)) == (void *)-1) {
+		BRK_UNLOCK();
+		return (void *)-1;
+	}
+	for (size_t i = (old_brk - heap) / MEM_CHUNKSIZE; i * MEM_CHUNKSIZE < (size_t)(mem_brk - heap); ++i)
+		owners[i] = (unsigned char)owner;
+	last_owner = owner;
+	BRK_UNLOCK();
+	return (void *)old_brk;
+}
+
+/*
+ * mem_owner - return the owner recorded for the chunk of p
+ */
+int mem_owner(const void *p) {
+	return owners[((const char *)p - heap) / MEM_CHUNKSIZE];
+}
+
+/*
+ * mem_map - map a region of size bytes, a multiple of the page size,
+ *		outside the brk heap. Return (void *)-1 if failed.
+ */
+void *mem_map(size_t size) {
+	size_t page = (size_t)getpagesize();
+	char *p;
+
+	p = mmap(NULL, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return (void *)-1;
+	*(size_t *)p = size;
+	BRK_LOCK();
+	mapped_size += size;
+	update_peak();
+	BRK_UNLOCK();
+	return (void *)(p + page);
+}
+
+/*
+ * mem_unmap - unmap the region at p from mem_map
+ */
+void mem_unmap(void *p) {
+	size_t page = (size_t)getpagesize();
+	char *lo = (char *)p - page;
+	size_t size = *(size_t *)lo;
+
+	BRK_LOCK();
+	mapped_size -= size;
+	BRK_UNLOCK();
+	munmap(lo, size + page);
+}
+
+/*
+ * mem_is_mapped - return whether p is outside the brk heap, i.e. in
+ *		a region from mem_map if it's a valid pointer
+ */
+int mem_is_mapped(const void *p) {
+	return (const char *)p < heap || (const char *)p >= mem_max_addr;
+}
+
+/*
+ * mem_in_heap - return whether bytes lo to hi lie in the brk heap, or
+ *		out of it, where the regions of mem_map and all the other
+ *		memory of the process can't be told apart
+ */
+int mem_in_heap(const void *lo, const void *hi) {
+	if ((const char *)lo >= heap && (const char *)lo < mem_max_addr)
+		return (const char *)hi < mem_brk;
+	return 1;
+}
+
+/*
+ * mem_peak_heapsize - returns the high water mark of the heap size plus
+ *		the mapped bytes since the last reset
+ */
+size_t mem_peak_heapsize(void) {
+	return peak_size;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo(){
+	return (void *)heap;
+}
+
+/*
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi(){
+	return (void *)(mem_brk - 1);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes
+ */
+size_t mem_heapsize() {
+	return (size_t)(mem_brk - heap);
+}
+
+/*
+ * mem_pagesize() - returns the page size of the system
+ */
+size_t mem_pagesize(){
+	return (size_t)getpagesize();
+}
@@ -2,26 +2,74 @@
  * mm.c
  *
  * - Using Segregated free lists, and every list is a Explicit free list
- *   We have 10 lists: {16}, {17~32}, ..., {2049~4096}, {4097~INF}.
- *   We don't set lists for block with size smaller than 16, because the
- *   minimum of size is 16 bytes.
+ *   The lists are indexed in two levels like TLSF: the first level is the
+ *   power of two of the size, and each power of two is split linearly into
+ *   2^MM_SL_LOG2 second level lists, e.g. {64~79}, {80~95}, {96~111}, {112~127}.
+ *   Blocks larger than the MM_FL_NUM first levels all go to the last list.
  * - The hole heap is an Implicit free list
- * - Every block has header and footer like textbook
- * - Every free block has 2 "pointers", which is actually 32 bytes 
- *   bias from heap pointer heap_listp. So we have to macros to help
+ * - Every block has a header like textbook, but only free blocks have
+ *   footer. The second lowest bit of header tells whether the previous
+ *   block is allocated, so we don't need its footer while coalescing
+ * - Every free block has 2 "pointers", which is actually 32 bits
+ *   bias from heap pointer heap_listp (64 bits with MM_WIDE). So we have to macros to help
  *   the bias and the pointer to transform
  * - For the first node of everylist, we put their bias at the start of heap, 
  *   and use seg_lists to find them
+ * - Right after the lists there are bitmaps of non-empty lists, one for each
+ *   first level and one for the first levels, so the list of a size is found
+ *   by a bit scan and the first non-empty list that fits by two find-first-set,
+ *   without walking the lists one by one
+ * - Requests no larger than MM_SLAB_MAX bytes are served by a slab allocator.
+ *   A run is a 4KB aligned allocated block split into slots of the same size,
+ *   with a bitmap of free slots in its head. Slots have no header and footer,
+ *   and a bitmap of run pages tells whether a pointer to free is a slot
+ * - Built with MM_THREADS, the heap is protected by a lock, and every thread
+ *   keeps a small cache of freed blocks for each size up to MM_TCACHE_MAX
+ *   bytes, like tcache of glibc. The caches are refilled and flushed in
+ *   batches so that the lock is taken once for many requests. Both are only
+ *   used once a second thread has called in
+ * - The heap is split into MM_ARENAS arenas, each with its own lists, lock
+ *   and chunks of memlib. A thread keeps to one arena (or the one of its CPU
+ *   with MM_ARENA_BY_CPU), and a block freed by another thread is pushed to
+ *   a lock-free list of its arena, which the owner drains under its lock
+ * - Requests of at least MM_MMAP_THRESHOLD bytes get a mapped region of
+ *   their own. The heap is trimmed when the free block at its end reaches
+ *   the trim threshold of the arena, which is raised if the heap grows back
+ * - Built with MM_FASTBIN_MAX, small freed blocks wait in fastbins of each
+ *   size without coalescing, till MM_FASTBIN_LIMIT bytes or a miss
+ * - MM_FIT_POLICY sets how a list is kept and searched: LIFO and first fit
+ *   by default, or sorted by size (best fit), sorted by address, or the best
+ *   of the first MM_FIT_SCAN blocks
+ * - Every first level and every slot size remembers its block last freed,
+ *   which is taken first while it fits without a split
+ * - memalign carves an aligned block out of a free block, and puts the
+ *   part before the aligned address back in the lists
+ * - mm_malloc_batch and mm_free_batch take the lock once for many blocks,
+ *   carve them from a free block, and free runs of neighbours as one block
+ * - Built with DEBUG, every call checks the blocks it touched, and the
+ *   whole heap is checked every MM_CHECK_EVERY calls of an arena
+ * - Built with MM_WIDE, every word (header, footer and bias) is 64 bits
+ *   instead of 32 bits, so that a block or a heap may be larger than 4GB
  * 
- * Blocks must be aligned to doubleword (8 byte) boundaries.
+ * Blocks must be aligned to doubleword (8 byte, or 16 byte with MM_WIDE
+ * or MM_ALIGN16) boundaries.
  * 
- * Minimum block size is 16 bytes. 
+ * Minimum block size is 4 words, 16 bytes or 32 bytes with MM_WIDE. 
  */
+#if defined(MM_THREADS) && defined(MM_ARENA_BY_CPU)
+#define _GNU_SOURCE /* for sched_getcpu */
+#endif
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "memlib.h"
 #include "mm.h"
@@ -42,40 +90,229 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define valloc mm_valloc
+#define pvalloc mm_pvalloc
+#define reallocarray mm_reallocarray
+#define malloc_usable_size mm_malloc_usable_size
 #endif /* def DRIVER */
 
 #define u_32 unsigned int
 
-/* single word (4) or double word (8) alignment */
-#define ALIGNMENT 8
+/*
+ * MM_WIDE selects the 64-bit layout: headers, footers and biases are
+ * 8 bytes and blocks are 16 byte aligned, so that blocks and heaps may be
+ * larger than 4GB. The default layout has 4 byte words and 8 byte alignment.
+ */
+#ifdef MM_WIDE
+#define word_t unsigned long
+#else
+#define word_t u_32
+#endif
+
+/*
+ * Size classes: 2^MM_SL_LOG2 second level lists for each of the MM_FL_NUM
+ * first levels. More lists give better fit but a larger heap header.
+ */
+#ifndef MM_SL_LOG2
+#define MM_SL_LOG2 2
+#endif
+#ifndef MM_FL_NUM
+#define MM_FL_NUM 20
+#endif
+
+/*
+ * Requests no larger than MM_SLAB_MAX bytes (a multiple of the alignment,
+ * 0 to disable) are served from runs of slots in steps of the alignment
+ */
+#ifndef MM_SLAB_MAX
+#define MM_SLAB_MAX 32
+#endif
+
+/*
+ * Runs are only made once the heap has MM_SLAB_HEAP bytes, below it a
+ * partly used run of each size is a large part of the heap
+ */
+#ifndef MM_SLAB_HEAP
+#define MM_SLAB_HEAP (1 << 17)
+#endif
+
+/*
+ * Thread caches (MM_THREADS only): blocks with payload up to MM_TCACHE_MAX
+ * bytes are cached per thread, at most MM_TCACHE_COUNT blocks for each
+ * size in steps of the alignment
+ */
+#ifndef MM_TCACHE_MAX
+#define MM_TCACHE_MAX 256
+#endif
+#ifndef MM_TCACHE_COUNT
+#define MM_TCACHE_COUNT 16
+#endif
+
+/*
+ * Arenas: with MM_THREADS, threads are spread over MM_ARENAS arenas, round-robin
+ * by default or by the CPU they run on with MM_ARENA_BY_CPU. A block is always
+ * freed to the arena that owns it
+ */
+#ifndef MM_ARENAS
+#ifdef MM_THREADS
+#define MM_ARENAS 4
+#else
+#define MM_ARENAS 1
+#endif
+#endif
+
+/*
+ * Requests of at least MM_MMAP_THRESHOLD bytes (0 to disable) get a mapped
+ * region of their own, which is unmapped on free. The heap is trimmed when
+ * the free block at its end reaches MM_TRIM_THRESHOLD bytes (0 to disable).
+ * If the heap grows again after a trim, the threshold of the arena is raised
+ * to twice the bytes given back, up to MM_TRIM_MAX, so that a program that
+ * keeps freeing and refilling the heap doesn't trim it every time
+ */
+#ifndef MM_MMAP_THRESHOLD
+#define MM_MMAP_THRESHOLD (1 << 20)
+#endif
+#ifndef MM_TRIM_THRESHOLD
+#define MM_TRIM_THRESHOLD (1 << 18)
+#endif
+#ifndef MM_TRIM_MAX
+#define MM_TRIM_MAX (1 << 26)
+#endif
+
+/*
+ * Fastbins (0 to disable): freed blocks of at most MM_FASTBIN_MAX bytes are
+ * kept in quick lists of each size without coalescing, and are coalesced in
+ * a batch when a malloc finds no fit or MM_FASTBIN_LIMIT bytes are kept
+ */
+#ifndef MM_FASTBIN_MAX
+#define MM_FASTBIN_MAX 0
+#endif
+#ifndef MM_FASTBIN_LIMIT
+#define MM_FASTBIN_LIMIT (1 << 16)
+#endif
+
+/*
+ * Order of blocks in a list, and how a fit is found in the list of the size:
+ * MM_FIT_BEST keeps the lists sorted by size, so the first fit is the best one.
+ * MM_FIT_FIRST inserts at the head (LIFO) and takes the first fit.
+ * MM_FIT_ADDRESS keeps the lists sorted by address and takes the first fit.
+ * MM_FIT_GOOD inserts at the head, and takes the best of the first
+ * MM_FIT_SCAN blocks, before it tries the larger lists.
+ * A second level list only holds sizes within 1/SL_NUM of a power of two,
+ * so LIFO loses little to best fit, and keeps free O(1) like TLSF
+ */
+#define MM_FIT_BEST 0
+#define MM_FIT_FIRST 1
+#define MM_FIT_ADDRESS 2
+#define MM_FIT_GOOD 3
+#ifndef MM_FIT_POLICY
+#define MM_FIT_POLICY MM_FIT_FIRST
+#endif
+#ifndef MM_FIT_SCAN
+#define MM_FIT_SCAN 8
+#endif
+
+/*
+ * Recent slots (0 to disable): each first level of lists, and each size
+ * of slots, remembers the block last freed to it, which is taken before
+ * the lists or the runs are searched if it fits as well, so that a malloc
+ * right after a free reuses the block still in cache
+ */
+#ifndef MM_RECENT
+#define MM_RECENT 1
+#endif
+
+/*
+ * With MM_ADDRESS_TIES, MM_FIT_BEST keeps the blocks of the same size in
+ * a list by address, so that the lowest one of a best fit is taken and
+ * the front of the heap stays dense
+ */
+
+/*
+ * Heap checks of DEBUG builds: every call checks the blocks it touched,
+ * their neighbours in the heap and their nodes in the lists, and the whole
+ * arena every MM_CHECK_EVERY calls (1 for every call, 0 for never). Errors
+ * go to stderr with the line of the call, the first MM_CHECK_REPORTS of them
+ */
+#ifndef MM_CHECK_EVERY
+#define MM_CHECK_EVERY 1024
+#endif
+#ifndef MM_CHECK_REPORTS
+#define MM_CHECK_REPORTS 100
+#endif
+
+#if MM_SL_LOG2 > 5 || MM_FL_NUM > 32
+#error "every level of bitmap must fit in a 32-bit word"
+#endif
+#if MM_ARENAS < 1 || MM_ARENAS > 256
+#error "memlib records the owner of a chunk in a byte"
+#endif
+#if MM_FIT_POLICY < MM_FIT_BEST || MM_FIT_POLICY > MM_FIT_GOOD
+#error "unknown MM_FIT_POLICY"
+#endif
+#if (defined(MM_WIDE) || defined(MM_ALIGN16)) && MM_SLAB_MAX % 16
+#error "slots of the 64-bit layout or MM_ALIGN16 are in steps of 16 bytes"
+#endif
+
+/*
+ * double word alignment, 8 bytes or 16 bytes with MM_WIDE, and 16 bytes
+ * with MM_ALIGN16 too, as malloc of the x86-64 ABI
+ */
+#if defined(MM_ALIGN16) && !defined(MM_WIDE)
+#define ALIGNMENT 16
+#else
+#define ALIGNMENT (2 * WSIZE)
+#endif
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(p) (((size_t)(p) + (ALIGNMENT - 1)) & ~0x7)
+#define ALIGN(p) (((size_t)(p) + (ALIGNMENT - 1)) & ~(size_t)(ALIGNMENT - 1))
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
 /* Basic constants and macros */
-#define WSIZE 4             /* Word and header/footer size (bytes) */ 
-#define DSIZE 8             /* Double word size (bytes) */
-#define CHUNKSIZE (1 << 12) /* Extend heap by this amount (bytes) */ 
+#define WSIZE ((int)sizeof(word_t)) /* Word and header/footer size (bytes) */
+#define DSIZE (2 * WSIZE)           /* Double word size (bytes) */
+#ifndef CHUNKSIZE
+#define CHUNKSIZE (1 << 12) /* Extend heap by this amount (bytes) */
+#endif
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define MIN(x, y) ((x) > (y) ? (y) : (x))
 
+/* Largest payload whose block size, or mapped region size, fits in a header */
+#define MAX_SIZE ((size_t)(word_t)~0x7 - 2 * CHUNKSIZE)
+
+/* Pointers that mm_free_batch copies to its stack and sorts at a time */
+#define FREE_BATCH_SORT 256
+
+/* Adjust a requested payload size to a block size with header and alignment */
+#define ADJUST_SIZE(size) (((size) <= (DSIZE + WSIZE)) ? (DSIZE << 1) : (ALIGN((size) + WSIZE)))
+
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc) ((size) | (alloc))
 
+/* Allocated bit of the previous block */
+#define PREV_ALLOC 0x2
+
 /* Read and write a word at address p */
-#define GET(p) (*(u_32 *)(p))
-#define PUT(p, val) (*(u_32 *)(p) = (val))
+#define GET(p) (*(word_t *)(p))
+#define PUT(p, val) (*(word_t *)(p) = (val))
 
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p) (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+
+/* Set and clear the previous block's allocated bit in header p */
+#define SET_PREV_ALLOC(p) (GET(p) |= PREV_ALLOC)
+#define CLEAR_PREV_ALLOC(p) (GET(p) &= ~PREV_ALLOC)
 
-/* Given block ptr bp, compute address of its header and footer */
+/* Given block ptr bp, compute address of its header and footer (free block only) */
 #define HDRP(bp) ((char *)(bp)-WSIZE)
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks */
+/* Given block ptr bp, compute address of next and previous blocks (previous block must be free) */
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp)-WSIZE)))
 #define PREV_BLKP(bp) ((char *)(bp)-GET_SIZE(((char *)(bp)-DSIZE)))
 
@@ -84,8 +321,8 @@
 #define PTR2NEXTBIAS(bp) ((char *)(bp) + WSIZE)
 
 /* Given free block ptr bp, compute "pointer"(bias) to next and previous free block in the list */
-#define PREV_FBP_BIAS(bp) (*((u_32 *)(PTR2PREVBIAS(bp))))
-#define NEXT_FBP_BIAS(bp) (*((u_32 *)(PTR2NEXTBIAS(bp))))
+#define PREV_FBP_BIAS(bp) (*((word_t *)(PTR2PREVBIAS(bp))))
+#define NEXT_FBP_BIAS(bp) (*((word_t *)(PTR2NEXTBIAS(bp))))
 
 /* 
  * Get pointer from bias
@@ -97,66 +334,321 @@
  * Get bias from pointer, and set the bias for a block that p points to
  * if the pointer is NULL, we don't compute the bias because it may overflow. Instead, we set bias to 0
  */
-#define P2B(base, ptr) (u_32)((size_t)(ptr) - (size_t)(base))
-#define SET_BIAS(p, bias) (GET(p) = (u_32)(bias)) // 将偏移量存储到p指向的区域
+#define P2B(base, ptr) (word_t)((size_t)(ptr) - (size_t)(base))
+#define SET_BIAS(p, bias) (GET(p) = (word_t)(bias)) // 将偏移量存储到p指向的区域
+
+/* Whether free block bp of asize bytes goes after node in its list */
+#if MM_FIT_POLICY == MM_FIT_BEST && defined(MM_ADDRESS_TIES)
+#define LIST_AFTER(node, bp, asize) \
+    ((asize) > GET_SIZE(HDRP(node)) || ((asize) == GET_SIZE(HDRP(node)) && (char *)(bp) > (char *)(node)))
+#elif MM_FIT_POLICY == MM_FIT_BEST
+#define LIST_AFTER(node, bp, asize) ((asize) > GET_SIZE(HDRP(node)))
+#elif MM_FIT_POLICY == MM_FIT_ADDRESS
+#define LIST_AFTER(node, bp, asize) ((char *)(bp) > (char *)(node))
+#else
+#define LIST_AFTER(node, bp, asize) 0
+#endif
+
+/* 
+ * MM_FL_NUM * SL_NUM lists. The first level 0 holds the sizes below
+ * 8 * SL_NUM in steps of 8, the first level i holds the sizes in
+ * [2^(i + MM_SL_LOG2 + 2), 2^(i + MM_SL_LOG2 + 3)), and the last list
+ * holds all the larger sizes too.
+ */
+#define SL_NUM (1 << MM_SL_LOG2)
+#define LISTNUM (MM_FL_NUM * SL_NUM)
+
+/* Given list index, compute its first and second level */
+#define FL_OF(index) ((index) >> MM_SL_LOG2)
+#define SL_OF(index) ((index) & (SL_NUM - 1))
+
+/*
+ * Bitmaps of non-empty lists, stored right after the first nodes of lists:
+ * the second level bitmaps, packed in the smallest type that holds SL_NUM
+ * bits, then the first level bitmap in a word
+ */
+#if MM_SL_LOG2 <= 3
+typedef unsigned char sl_map_t;
+#elif MM_SL_LOG2 == 4
+typedef unsigned short sl_map_t;
+#else
+typedef u_32 sl_map_t;
+#endif
+#define SL_MAP_WORDS ((int)((MM_FL_NUM * sizeof(sl_map_t) + WSIZE - 1) / WSIZE))
+#define SL_BITMAP(fl) (((sl_map_t *)(arena->seg_lists + LISTNUM))[fl])
+#define FL_BITMAP (arena->seg_lists[LISTNUM + SL_MAP_WORDS])
 
 /* 
- * 10 lists:
- * {16},{17~32}, {33~64},{65~128},{129~256},{257~512},
- * {513~1024},{1025~2048},{2049~4096},{4097~INF}
+ * Slab: SLAB_NUM sizes of slots in steps of ALIGNMENT, {8}, {16}, ..., {MM_SLAB_MAX}.
+ * A run is a block whose pointer is aligned to RUN_SIZE, it holds
+ * the run head and then the slots, till the header of the next block.
+ */
+#define SLAB_NUM (MM_SLAB_MAX / ALIGNMENT)
+#define RUN_SHIFT 12
+#define RUN_SIZE (1 << RUN_SHIFT)
+#define RUN_MAP_WORDS ((RUN_SIZE / ALIGNMENT + 31) / 32)
+
+typedef struct
+{
+    word_t prev;                 /* bias of previous run that has free slots */
+    word_t next;                 /* bias of next run that has free slots */
+    unsigned short slot_size;    /* size of every slot */
+    unsigned short nfree;        /* number of free slots */
+    u_32 free_map[RUN_MAP_WORDS]; /* bit is set if the slot is free */
+} run_t;
+
+#define RUN_HSIZE ALIGN(sizeof(run_t))
+
+/* Given slot size, compute the number of slots in a run */
+#define RUN_SLOTS(slot_size) ((RUN_SIZE - WSIZE - RUN_HSIZE) / (slot_size))
+
+/* Given run, compute the address of its slot i */
+#define RUN_SLOT(run, i) ((char *)(run) + RUN_HSIZE + (i) * (run)->slot_size)
+
+/* Round p up to the next run boundary */
+#define RUN_ALIGN(p) (((size_t)(p) + (RUN_SIZE - 1)) & ~(size_t)(RUN_SIZE - 1))
+
+/*
+ * A size is served by normal blocks until it has been requested RUN_WARMUP
+ * times, so that a run is not wasted on a size that is rarely used, and
+ * while the heap is smaller than MM_SLAB_HEAP
+ */
+#define RUN_WARMUP(size) (2 * RUN_SLOTS(ALIGN(size)))
+#define RUN_READY(size) \
+    (RUN_DEMAND(((size) - 1) / ALIGNMENT) >= RUN_WARMUP(size) && mem_heapsize() >= MM_SLAB_HEAP)
+
+/*
+ * After the bitmaps: bias of first runs that have free slots for each size,
+ * then bias and number of bits of the page bitmap telling which pages are runs,
+ * then the number of requests of each size so far, none of them without a slab.
+ * The page bitmap is a normal allocated block, and grows when needed.
+ */
+#define RUN_WORDS (MM_SLAB_MAX > 0 ? 2 * SLAB_NUM + 2 : 0)
+#define RUN_LISTS (arena->seg_lists + LISTNUM + SL_MAP_WORDS + 1)
+#define RUN_MAP_BIAS (RUN_LISTS[SLAB_NUM])
+#define RUN_MAP_BITS (RUN_LISTS[SLAB_NUM + 1])
+#define RUN_DEMAND(slab_index) (RUN_LISTS[SLAB_NUM + 2 + (slab_index)])
+
+/*
+ * Then the bias of first blocks in fastbins, FAST_NUM sizes in steps of
+ * ALIGNMENT, and the bytes kept in all fastbins. A block in a fastbin
+ * is still allocated for the heap, and links to the next one by its
+ * first word. Without fastbins there are no words for them
+ */
+#define FAST_NUM (MM_FASTBIN_MAX / ALIGNMENT)
+#define FAST_WORDS (MM_FASTBIN_MAX > 0 ? FAST_NUM + 1 : 0)
+#define FAST_LISTS (RUN_LISTS + RUN_WORDS)
+#if MM_FASTBIN_MAX > 0
+#define FAST_BYTES (FAST_LISTS[FAST_NUM])
+#else
+#define FAST_BYTES ((word_t)0)
+#endif
+#define FAST_INDEX(asize) ((asize) / ALIGNMENT - 1)
+
+/*
+ * Then the bias of the recent block of every first level, the one last
+ * freed to its lists, or 0 once it's taken out, and of the recent slot
+ * of every size, the one last freed to the runs. The recent block is
+ * only taken if it's no larger than a block that wouldn't be split
+ */
+#define RECENT_NUM (MM_RECENT ? MM_FL_NUM + SLAB_NUM : 0)
+#define RECENT_LISTS (FAST_LISTS + FAST_WORDS)
+#define RECENT_SLOTS (RECENT_LISTS + MM_FL_NUM)
+
+/* Given pointer p, compute its page index for the page bitmap */
+#define PAGE_INDEX(p) (((size_t)(p) >> RUN_SHIFT) - ((size_t)arena->seg_lists >> RUN_SHIFT))
+
+/*
+ * A mapped block starts ALIGNMENT bytes into its region, and its header
+ * holds the size of the whole region. Only mapped blocks are out of
+ * the brk heap
+ */
+#define IS_MAPPED(bp) (MM_MMAP_THRESHOLD > 0 && mem_is_mapped(bp))
+
+/*
+ * Number of words at the start of heap, 3 words short of a multiple of
+ * the alignment (odd for double words), so that the first block is aligned
  */
-#define LISTNUM 10
+#define META_WORDS ((((LISTNUM + SL_MAP_WORDS + 1 + RUN_WORDS + FAST_WORDS + RECENT_NUM) + 2) | (ALIGNMENT / WSIZE - 1)) - 2)
+
+/*
+ * An arena is a heap of its own, with its lists, prologue and epilogue.
+ * The arena struct is at the start of its first chunk, right before
+ * the first nodes of lists.
+ */
+typedef struct
+{
+    char *heap_listp; /* Pointer to first block */
+    word_t *seg_lists; /* bias of first nodes in lists */
+    char *top;        /* end of the heap of the arena, right after the epilogue */
+    char *end;        /* end of the last chunk of the arena */
+    int id;           /* index in arenas, and owner of its chunks in memlib */
+    size_t trim_threshold; /* free bytes at the end of heap that trim it */
+    size_t trimmed;        /* bytes given back by the last trim, till the heap grows */
+#ifdef MM_THREADS
+    pthread_mutex_t lock; /* every change of blocks and lists is made holding it */
+    void *remote;         /* blocks freed by other threads, pushed without the lock */
+#endif
+} arena_t;
 
 /* Global variables */
-static char *heap_listp = NULL; /* Pointer to first block */
-static u_32 *seg_lists = NULL;  /* bias of first nodes in lists */
+static arena_t *arenas[MM_ARENAS]; /* created on first use, arenas[0] by mm_init */
+
+/*
+ * Counters of every arena, changed with its lock held, and of the
+ * mapped blocks, changed by anyone. They are kept out of the heap so
+ * that they don't cost utilization
+ */
+static mm_stats_t arena_stats[MM_ARENAS];
+static size_t map_count, unmap_count, mapped_bytes;
+#define STATS (arena_stats[arena->id])
+
+/* Calls of every arena since its last full check, and errors found, with DEBUG */
+static unsigned check_calls[MM_ARENAS];
+static unsigned long check_errors;
+
+#ifdef MM_THREADS
+static __thread arena_t *arena = NULL;  /* the arena this thread is working on */
+#ifndef MM_ARENA_BY_CPU
+static __thread int arena_index = -1;  /* the arena assigned to this thread */
+static unsigned next_arena = 0;        /* for round-robin assignment */
+#endif
+static __thread int thread_seen = 0;   /* this thread has called the allocator */
+static unsigned threads_seen = 0;      /* the threads that have */
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define LOCK(a) pthread_mutex_lock(&(a)->lock)
+#define UNLOCK(a) pthread_mutex_unlock(&(a)->lock)
+#define ATOMIC_ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+
+#define TCACHE_NUM (MM_TCACHE_MAX / ALIGNMENT + 1)
+
+/*
+ * Cache of a thread. Bin i holds blocks with usable size in
+ * [ALIGNMENT * i, ALIGNMENT * (i + 1)),
+ * linked through their first word. Blocks in the cache are still
+ * allocated for the heap. The caches are dropped when mm_init starts a
+ * new heap, which is told by the generation of heap.
+ */
+typedef struct
+{
+    void *bins[TCACHE_NUM];
+    unsigned short counts[TCACHE_NUM];
+    unsigned gen;
+    int registered;
+} tcache_t;
+
+static __thread tcache_t tcache;
+static unsigned heap_gen = 0;              /* generation of heap, bumped by mm_init */
+static pthread_key_t tcache_key;           /* to flush the cache when a thread exits */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* Given cached block bp, the next block in the same bin, or in the remote list */
+#define TC_NEXT(bp) (*(void **)(bp))
+#else
+static arena_t *arena = NULL; /* the arena we are working on */
 
+#define LOCK(a)
+#define UNLOCK(a)
+#define ATOMIC_ADD(x, n) ((x) += (n))
+#endif
+
+static arena_t *arena_new(int id);
+static arena_t *arena_of(const void *bp);
+static arena_t *thread_arena(void);
+static void *arena_sbrk(size_t size);
+static void check_arena(int lineno);
+static void check_error(int lineno, const void *p, const char *msg);
+static void check_block(void *bp, int lineno);
+static void check_node(void *bp, int lineno);
+static void check_run(run_t *run, int lineno);
+static void *check_freeing(void *bp);
+static void check_touched(void *bp, int lineno);
+static void check_call(void *bp, int lineno);
+static void *map_block(size_t size);
+static void unmap_block(void *bp);
+static void *remap_block(void *oldptr, size_t size);
+static void trim_heap(void *bp);
 static void *extend_heap(size_t size);
 static void *coalesce(void *bp);
 static void *place(void *bp, size_t size);
 static void add_to_list(void *bp, size_t asize);
 static void remove_from_list(void *bp, size_t asize);
+static void trim(void *bp, size_t asize);
+static u_32 list_index_of(size_t asize);
+static void *find_fit(size_t asize);
+static void *alloc_block(size_t asize);
+static void *slab_malloc(size_t size);
+static void slab_free(run_t *run, void *bp);
+static run_t *run_of(const void *bp);
+static run_t *new_run(size_t slot_size);
+static int mark_run(run_t *run, int is_run);
+static void *do_malloc(size_t size);
+static void do_free(void *bp);
+static void free_block(void *bp);
+static void *fast_get(size_t asize);
+static void fast_put(void *bp, size_t asize);
+static void consolidate(void);
+static void *do_realloc(void *oldptr, size_t size);
+static size_t aligned_lead(const void *bp, size_t alignment);
+static void *find_aligned(size_t asize, size_t alignment);
+static void *do_memalign(size_t alignment, size_t size);
+static size_t carve_blocks(size_t asize, size_t n, void **ptrs);
+static void sift_ptr(void **ptrs, size_t k, size_t n);
+static void sort_ptrs(void **ptrs, size_t n);
+static void free_sorted(void **ptrs, size_t n);
+#ifdef MM_THREADS
+static int many_threads(void);
+static tcache_t *tcache_self(void);
+static void *tcache_get(size_t size);
+static int tcache_put(void *bp);
+static void tcache_flush(tcache_t *tc, size_t index, size_t keep);
+static void tcache_exit(void *arg);
+static void tcache_key_init(void);
+static void remote_free(arena_t *a, void *bp);
+static void remote_drain(void);
+#endif
 
 static int in_heap(const void *p);
 static int aligned(const void *p);
+static u_32 stat_class(size_t size);
+static size_t block_size(const void *bp);
+static void stat_alloc(void *bp);
+static void stat_free(void *bp);
 
 int mm_init(void);
 void *malloc(size_t size);
 void free(void *bp);
 void *realloc(void *oldptr, size_t size);
 void *calloc(size_t nmemb, size_t size);
+void *memalign(size_t alignment, size_t size);
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+void *valloc(size_t size);
+void *pvalloc(size_t size);
+void *reallocarray(void *oldptr, size_t nmemb, size_t size);
+size_t malloc_usable_size(void *bp);
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+void mm_free_batch(void **ptrs, size_t n);
 void mm_checkheap(int lineno);
+void mm_stats(mm_stats_t *stats);
+void mm_heap_snapshot(FILE *out);
 
 /*
  * mm_init - Initialize the memory manager 
+ * it must not run at the same time as other calls
  * return -1 on error, 0 on success.
  */
 int mm_init(void)
 {
-    /* initialize the heap first */
-    if ((heap_listp = mem_sbrk(14 * WSIZE)) == (void *)-1)
-        return -1;
-    /*initialize the array of bias of lists' first nodes*/
-    PUT(heap_listp + (0 * WSIZE), 0);  // {16}
-    PUT(heap_listp + (1 * WSIZE), 0);  // {17~32}
-    PUT(heap_listp + (2 * WSIZE), 0);  // {33~64}
-    PUT(heap_listp + (3 * WSIZE), 0);  // {65~128}
-    PUT(heap_listp + (4 * WSIZE), 0);  // {129~256}
-    PUT(heap_listp + (5 * WSIZE), 0);  // {257~512}
-    PUT(heap_listp + (6 * WSIZE), 0);  // {513~1024}
-    PUT(heap_listp + (7 * WSIZE), 0);  // {1025~2048}
-    PUT(heap_listp + (8 * WSIZE), 0);  // {2049~4096}
-    PUT(heap_listp + (9 * WSIZE), 0);  // {4097~INF}
-    PUT(heap_listp + (10 * WSIZE), 0); // just for align
-    /* Prologue and Epilogue */
-    PUT(heap_listp + (11 * WSIZE), PACK(DSIZE, 1));
-    PUT(heap_listp + (12 * WSIZE), PACK(DSIZE, 1));
-    PUT(heap_listp + (13 * WSIZE), PACK(0, 1));
-
-    seg_lists = heap_listp;
-    heap_listp += (12 * WSIZE);
-
-    if (extend_heap(CHUNKSIZE) == NULL)
+#ifdef MM_THREADS
+    /* blocks cached by any thread are in the old heap */
+    ++heap_gen;
+#endif
+    memset(arenas, 0, sizeof(arenas));
+    memset(arena_stats, 0, sizeof(arena_stats));
+    map_count = unmap_count = mapped_bytes = 0;
+    if ((arenas[0] = arena_new(0)) == NULL)
         return -1;
 #ifdef DEBUG
     mm_checkheap(__LINE__);
@@ -170,335 +662,2112 @@ int mm_init(void)
  */
 void *malloc(size_t size)
 {
-    size_t asize; // actual size after align
-    size_t extendsize;
-    char *bp = NULL;
-    u_32 list_index; // which list?
-
-    if (heap_listp == NULL)
-        mm_init();
+    arena_t *a;
+    char *bp;
 
     if (!size)
         return NULL;
 
-    asize = (size <= DSIZE) ? (DSIZE << 1) : (ALIGN(size + DSIZE));
-
-    /* Get which list should we get the free block */
-    for (list_index = 0; list_index < (LISTNUM - 1); ++list_index)
-    {
-        if (((asize <= (16 << list_index)) && (seg_lists[list_index] != 0)))
-        {
-            bp = B2P(heap_listp, seg_lists[list_index]);
-            /* search fit free block for malloc */
-            while ((bp != NULL) && ((asize > GET_SIZE(HDRP(bp)))))
-                bp = B2P(heap_listp, NEXT_FBP_BIAS(bp));
-            if (bp != NULL)
-                break;
-        }
-    }
-    if (bp == NULL) /* can't find the block */
-    {
-        /* search the last list: {4097 ~ INF} */
-        bp = B2P(heap_listp, seg_lists[list_index]);
-        while ((bp != NULL) && ((asize > GET_SIZE(HDRP(bp)))))
-            bp = B2P(heap_listp, NEXT_FBP_BIAS(bp));
-    }
-
-    /* have to extend heap */
-    if (bp == NULL)
-    {
-        if ((bp = extend_heap(MAX(asize, CHUNKSIZE))) == NULL)
-            return NULL;
-    }
-    /* place the block */
-    bp = place(bp, asize);
+#ifdef MM_THREADS
+    /* first try the cache of this thread */
+    if ((bp = tcache_get(size)) != NULL)
+        return bp;
+#endif
 
+    if ((a = thread_arena()) == NULL)
+        return NULL;
+    LOCK(a);
+    arena = a;
+#ifdef MM_THREADS
+    remote_drain();
+#endif
+    if ((bp = do_malloc(size)) != NULL)
+        stat_alloc(bp);
 #ifdef DEBUG
-    mm_checkheap(__LINE__);
+    check_call(bp, __LINE__);
 #endif
+    UNLOCK(a);
     return bp;
 }
 
 /*
- * free - Free a block 
+ * free - Free a block to the arena that owns it
  */
 void free(void *bp)
 {
-    if (heap_listp == 0)
-        mm_init();
+    arena_t *a;
+#ifdef DEBUG
+    void *touched;
+#endif
+
     if (bp == NULL)
         return;
-    size_t asize = GET_SIZE(HDRP(bp));
-    /* refresh footer and header */
-    PUT(HDRP(bp), PACK(asize, 0));
-    PUT(FTRP(bp), PACK(asize, 0));
-    /* refresh the lists */
-    add_to_list(bp, asize);
-    /* after free, check coalesce immediately */
-    coalesce(bp);
+    if (IS_MAPPED(bp))
+    {
+        unmap_block(bp);
+        return;
+    }
+
+#ifdef MM_THREADS
+    /* first try to keep it in the cache of this thread */
+    if (tcache_put(bp))
+        return;
+#endif
 
+    if (arenas[0] == NULL)
+        mm_init();
+    a = arena_of(bp);
+#ifdef MM_THREADS
+    /* a block of another arena is left to its owner */
+    if (a != thread_arena())
+    {
+        remote_free(a, bp);
+        return;
+    }
+#endif
+    LOCK(a);
+    arena = a;
+    stat_free(bp);
 #ifdef DEBUG
-    mm_checkheap(__LINE__);
+    touched = check_freeing(bp);
+#endif
+    do_free(bp);
+#ifdef DEBUG
+    check_call(touched, __LINE__);
 #endif
+    UNLOCK(a);
 }
 
 /*
- * realloc - reallocate the block with new size
+ * realloc - reallocate the block with new size, in the arena that owns it
  * return NULL if failed
  */
 void *realloc(void *oldptr, size_t size)
 {
-    size_t oldsize;
+    arena_t *a;
     void *newptr;
-    /* new size is 0, just free */
-    if (size == 0)
-    {
-        mm_free(oldptr);
-        return 0;
-    }
-    /* old block don't exist, just malloc */
-    if (oldptr == NULL)
-        return mm_malloc(size);
-    
-    /* first malloc a block */
-    newptr = mm_malloc(size); 
-    if (!newptr)
-        return 0;
 
-    /* get new and old black's payload size */
-    size = GET_SIZE(HDRP(newptr)) - DSIZE;
-    oldsize = GET_SIZE(HDRP(oldptr)) - DSIZE;
+    if (oldptr != NULL && IS_MAPPED(oldptr))
+        return remap_block(oldptr, size);
+    if ((a = (oldptr == NULL) ? thread_arena() : arena_of(oldptr)) == NULL)
+        return NULL;
+    LOCK(a);
+    arena = a;
+    newptr = do_realloc(oldptr, size);
+#ifdef DEBUG
+    check_call(newptr, __LINE__);
+#endif
+    UNLOCK(a);
+    return newptr;
+}
 
-    if (size < oldsize)
-        oldsize = size;
-    memcpy(newptr, oldptr, oldsize);
-    /* free old block after copy */
-    mm_free(oldptr);
+/*
+ * calloc - allocate nmemb * size bytes of payload cleared to zero
+ * mapped regions and the memory just got from memlib are zero already,
+ * so only the part of payload below the old top of heap is cleared,
+ * with the words the free block left in the rest
+ * return NULL if failed or nmemb * size overflows
+ */
+void *calloc(size_t nmemb, size_t size)
+{
+    arena_t *a;
+    size_t asize, clear;
+    char *bp, *top;
 
-    return newptr;
+    if (nmemb && size > SIZE_MAX / nmemb)
+        return NULL;
+    asize = nmemb * size;
+    if (!asize)
+        return NULL;
+
+#ifdef MM_THREADS
+    /* a cached block was used before */
+    if ((bp = tcache_get(asize)) != NULL)
+    {
+        memset(bp, 0, asize);
+        return bp;
+    }
+#endif
 
+    if ((a = thread_arena()) == NULL)
+        return NULL;
+    LOCK(a);
+    arena = a;
+#ifdef MM_THREADS
+    remote_drain();
+#endif
+    top = a->top;
+    if ((bp = do_malloc(asize)) != NULL)
+        stat_alloc(bp);
+    clear = asize;
+    if (bp == NULL || IS_MAPPED(bp))
+        clear = 0;
+    else if (bp + asize > top && run_of(bp) == NULL)
+    {
+        /* the links and the footer of the new free block are left too */
+        clear = MIN(asize, ((bp < top) ? (size_t)(top - bp) : 0) + DSIZE);
+        if (FTRP(bp) >= top && FTRP(bp) < bp + asize)
+            PUT(FTRP(bp), 0);
+    }
 #ifdef DEBUG
-    mm_checkheap(__LINE__);
+    check_call(bp, __LINE__);
 #endif
+    UNLOCK(a);
+    /* the block is ours, clear it without the lock */
+    if (clear)
+        memset(bp, 0, clear);
+    return bp;
 }
 
 /*
- * calloc - simple, just malloc and memset
+ * memalign - allocate a block with size bytes of payload aligned to
+ * alignment, a power of two
+ * return NULL if failed
  */
-void *calloc(size_t nmemb, size_t size)
+void *memalign(size_t alignment, size_t size)
 {
-    size_t asize = nmemb * size;
-    void *newptr;
+    arena_t *a;
+    char *bp;
 
-    newptr = mm_malloc(asize);
-    memset(newptr, 0, GET_SIZE(HDRP(newptr)));
+    if (alignment & (alignment - 1))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT)
+        return malloc(size);
+    if (!size)
+        return NULL;
 
+    if ((a = thread_arena()) == NULL)
+        return NULL;
+    LOCK(a);
+    arena = a;
+#ifdef MM_THREADS
+    remote_drain();
+#endif
+    if ((bp = do_memalign(alignment, size)) != NULL)
+        stat_alloc(bp);
 #ifdef DEBUG
-    mm_checkheap(__LINE__);
+    check_call(bp, __LINE__);
 #endif
-    return newptr;
+    UNLOCK(a);
+    return bp;
 }
 
 /*
- * Return whether the pointer is in the heap.
- * May be useful for debugging.
+ * posix_memalign - memalign that returns the block in memptr, the
+ * alignment must be a power of two multiple of sizeof(void *)
+ * return 0, EINVAL or ENOMEM
  */
-static int in_heap(const void *p)
+int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
-    return p <= mem_heap_hi() && p >= mem_heap_lo();
+    void *bp;
+
+    if (alignment == 0 || alignment % sizeof(void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+    if ((bp = memalign(alignment, size)) == NULL && size)
+        return ENOMEM;
+    *memptr = bp;
+    return 0;
 }
 
 /*
- * Return whether the pointer is aligned.
- * May be useful for debugging.
+ * aligned_alloc - the C11 name of memalign
  */
-static int aligned(const void *p)
+void *aligned_alloc(size_t alignment, size_t size)
 {
-    return (size_t)ALIGN(p) == (size_t)p;
+    return memalign(alignment, size);
 }
 
 /*
- * mm_checkheap - check correctness
- * first check gloable pointers
- * then check the blocks in heap -- The header and footer, the alignment, and in_heap check
- * finally check the list -- neighbour free blocks should be coalesced and size should fit the list
+ * valloc - memalign to the page size
  */
-void mm_checkheap(int lineno)
+void *valloc(size_t size)
 {
-    int error_found = 0;
+    return memalign(mem_pagesize(), size);
+}
 
-    /* first check gloable pointers */
-    if (heap_listp == NULL)
-    {
-        dbg_printf("line %d: heap not initialized\n", lineno);
-        error_found = 1;
-    }
-    if (seg_lists == NULL)
-    {
-        dbg_printf("line %d: segregated lists not initialized\n", lineno);
-        error_found = 1;
-    }
+/*
+ * pvalloc - valloc of size rounded up to whole pages
+ */
+void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+/*
+ * reallocarray - realloc of nmemb * size bytes
+ * return NULL if failed or nmemb * size overflows
+ */
+void *reallocarray(void *oldptr, size_t nmemb, size_t size)
+{
+    if (nmemb && size > SIZE_MAX / nmemb)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(oldptr, nmemb * size);
+}
+
+/*
+ * malloc_usable_size - return the bytes of payload of block bp, which
+ * may be more than it was asked for
+ */
+size_t malloc_usable_size(void *bp)
+{
+    run_t *run;
+
+    if (bp == NULL)
+        return 0;
+    if (IS_MAPPED(bp))
+        return GET_SIZE(HDRP(bp)) - ALIGNMENT;
+    if (arenas[0] == NULL)
+        return 0;
+    arena = arena_of(bp);
+    if ((run = run_of(bp)) != NULL)
+        return run->slot_size;
+    return GET_SIZE(HDRP(bp)) - WSIZE;
+}
+
+/*
+ * mm_malloc_batch - allocate n blocks of size bytes of payload to ptrs,
+ * holding the lock once. Blocks of the lists are carved out of the free
+ * blocks by carve_blocks, the others are allocated one by one
+ * return the number of blocks allocated, fewer than n if out of memory
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs)
+{
+    arena_t *a;
+    size_t i = 0;
+
+    if (!size || !n || size > MAX_SIZE)
+        return 0;
+    if ((a = thread_arena()) == NULL)
+        return 0;
+    LOCK(a);
+    arena = a;
+#ifdef MM_THREADS
+    remote_drain();
+#endif
+    if (size > MM_SLAB_MAX && n <= MAX_SIZE / ADJUST_SIZE(size)
+#if MM_MMAP_THRESHOLD > 0
+        && size < MM_MMAP_THRESHOLD
+#endif
+    )
+        i = carve_blocks(ADJUST_SIZE(size), n, ptrs);
+    while (i < n && (ptrs[i] = do_malloc(size)) != NULL)
+        ++i;
+    for (size_t j = 0; j < i; ++j)
+    {
+        stat_alloc(ptrs[j]);
+#ifdef DEBUG
+        check_touched(ptrs[j], __LINE__);
+#endif
+    }
+#ifdef DEBUG
+    check_call(NULL, __LINE__);
+#endif
+    UNLOCK(a);
+    return i;
+}
+
+/*
+ * mm_free_batch - free the n blocks in ptrs, FREE_BATCH_SORT at a time,
+ * each copied and sorted by address first, so that every run of
+ * neighbouring blocks is freed and coalesced as one block
+ * ptrs itself is not changed
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    void *sorted[FREE_BATCH_SORT];
+    size_t i, k;
+
+    for (i = 0; i < n; i += k)
+    {
+        k = MIN(n - i, FREE_BATCH_SORT);
+        memcpy(sorted, ptrs + i, k * sizeof(void *));
+        sort_ptrs(sorted, k);
+        free_sorted(sorted, k);
+    }
+}
+
+/*
+ * free_sorted - free the n blocks in ptrs, sorted by address, taking
+ * the lock of an arena once for all its blocks
+ */
+static void free_sorted(void **ptrs, size_t n)
+{
+    arena_t *a = NULL, *owner;
+    char *bp, *end;
+    size_t i, j;
+#ifdef DEBUG
+    void *touched;
+#endif
+
+    for (i = 0; i < n; i = j)
+    {
+        bp = ptrs[i];
+        j = i + 1;
+        if (bp == NULL)
+            continue;
+        if (IS_MAPPED(bp))
+        {
+            unmap_block(bp);
+            continue;
+        }
+        if (arenas[0] == NULL)
+            mm_init();
+        owner = arena_of(bp);
+#ifdef MM_THREADS
+        /* a block of another arena is left to its owner */
+        if (owner != thread_arena())
+        {
+            remote_free(owner, bp);
+            continue;
+        }
+#endif
+        if (owner != a)
+        {
+#ifdef MM_THREADS
+            if (a != NULL)
+                UNLOCK(a);
+#endif
+            LOCK(owner);
+            a = owner;
+        }
+        arena = a;
+        stat_free(bp);
+#ifdef DEBUG
+        touched = check_freeing(bp);
+#endif
+
+        /* the blocks right after it in the heap are the next ones in ptrs */
+        end = bp;
+        if (run_of(bp) == NULL)
+            for (end = NEXT_BLKP(bp); j < n && ptrs[j] == end; end = NEXT_BLKP(end), ++j)
+                stat_free(end);
+        if (j == i + 1)
+            do_free(bp);
+        else
+        {
+            STATS.coalesces += j - i - 1;
+            PUT(HDRP(bp), PACK(end - bp, GET_PREV_ALLOC(HDRP(bp)) | 1));
+            free_block(bp);
+        }
+#ifdef DEBUG
+        check_touched(touched, __LINE__);
+#endif
+    }
+    if (a != NULL)
+    {
+#ifdef DEBUG
+        check_call(NULL, __LINE__);
+#endif
+        UNLOCK(a);
+    }
+}
+
+/*
+ * do_malloc - malloc with the heap lock held
+ */
+static void *do_malloc(size_t size)
+{
+    char *bp;
+
+    if (!size || size > MAX_SIZE)
+        return NULL;
+
+#if MM_MMAP_THRESHOLD > 0
+    /* huge request, map a region for it */
+    if (size >= MM_MMAP_THRESHOLD)
+        return map_block(size);
+#endif
+
+    /* small request, get a slot from the slab once the size is used enough */
+    if (size <= MM_SLAB_MAX && RUN_READY(size))
+        bp = slab_malloc(size);
+    else
+    {
+        if (size <= MM_SLAB_MAX)
+            ++RUN_DEMAND((size - 1) / ALIGNMENT);
+        if ((bp = fast_get(ADJUST_SIZE(size))) == NULL)
+            bp = alloc_block(ADJUST_SIZE(size));
+    }
+
+    return bp;
+}
+
+/*
+ * do_free - free with the heap lock held
+ */
+static void do_free(void *bp)
+{
+    if (bp == NULL)
+        return;
+    run_t *run = run_of(bp);
+    if (run != NULL) /* a slot, give it back to its run */
+    {
+        slab_free(run, bp);
+        return;
+    }
+#if MM_FASTBIN_MAX > 0
+    /* a small block waits in its fastbin, and is coalesced later */
+    if (GET_SIZE(HDRP(bp)) <= MM_FASTBIN_MAX)
+    {
+        fast_put(bp, GET_SIZE(HDRP(bp)));
+        return;
+    }
+#endif
+    free_block(bp);
+}
+
+/*
+ * free_block - make allocated block bp free, put it in the lists and
+ * coalesce it right away
+ */
+static void free_block(void *bp)
+{
+    size_t asize = GET_SIZE(HDRP(bp));
+    /* refresh footer and header, and tell the next block */
+    PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp))));
+    PUT(FTRP(bp), PACK(asize, 0));
+    CLEAR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    /* refresh the lists */
+    add_to_list(bp, asize);
+    /* after free, check coalesce immediately */
+    bp = coalesce(bp);
+#if MM_RECENT
+    RECENT_LISTS[FL_OF(list_index_of(GET_SIZE(HDRP(bp))))] = P2B(arena->heap_listp, bp);
+#endif
+
+#if MM_TRIM_THRESHOLD > 0
+    /* give back the memory at the end of heap if too much is free */
+    if (GET_SIZE(HDRP(bp)) >= arena->trim_threshold && GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0)
+        trim_heap(bp);
+#endif
+}
+
+/*
+ * fast_get - take a block of exactly asize bytes from its fastbin
+ * return NULL if the fastbin is empty
+ */
+static inline void *fast_get(size_t asize)
+{
+#if MM_FASTBIN_MAX > 0
+    char *bp;
+
+    if (asize > MM_FASTBIN_MAX)
+        return NULL;
+    if ((bp = B2P(arena->heap_listp, FAST_LISTS[FAST_INDEX(asize)])) == NULL)
+        return NULL;
+    FAST_LISTS[FAST_INDEX(asize)] = GET(bp);
+    FAST_BYTES -= asize;
+    return bp;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * fast_put - push allocated block bp of asize bytes to its fastbin,
+ * and coalesce all the fastbins if they keep too many bytes
+ */
+static void fast_put(void *bp, size_t asize)
+{
+#if MM_FASTBIN_MAX > 0
+    SET_BIAS(bp, FAST_LISTS[FAST_INDEX(asize)]);
+    FAST_LISTS[FAST_INDEX(asize)] = P2B(arena->heap_listp, bp);
+    FAST_BYTES += asize;
+    if (FAST_BYTES >= MM_FASTBIN_LIMIT)
+        consolidate();
+#endif
+}
+
+/*
+ * consolidate - free every block in the fastbins to the lists,
+ * coalescing them with their neighbours
+ */
+static void consolidate(void)
+{
+#if MM_FASTBIN_MAX > 0
+    char *bp;
+
+    for (int i = 0; i < FAST_NUM; ++i)
+    {
+        while ((bp = B2P(arena->heap_listp, FAST_LISTS[i])) != NULL)
+        {
+            FAST_LISTS[i] = GET(bp);
+            free_block(bp);
+        }
+    }
+    FAST_BYTES = 0;
+#endif
+}
+
+/*
+ * do_realloc - realloc with the heap lock held
+ * try to shrink or grow the block in place, and only copy
+ * the payload to a new block as a last resort
+ */
+static void *do_realloc(void *oldptr, size_t size)
+{
+    size_t asize, oldsize, next_size;
+    void *newptr;
+    void *next_bp;
+    run_t *run;
+    /* new size is 0, just free */
+    if (size == 0)
+    {
+        if (oldptr != NULL)
+            stat_free(oldptr);
+        do_free(oldptr);
+        return 0;
+    }
+    /* old block don't exist, just malloc */
+    if (oldptr == NULL)
+    {
+        if ((newptr = do_malloc(size)) != NULL)
+            stat_alloc(newptr);
+        return newptr;
+    }
+    if (size > MAX_SIZE)
+        return NULL;
+
+    /* a slot can only be resized in place inside the slot */
+    if ((run = run_of(oldptr)) != NULL)
+    {
+        if (size <= run->slot_size)
+        {
+            ++STATS.realloc_in_place;
+            return oldptr;
+        }
+        if ((newptr = do_malloc(size)) == NULL)
+            return 0;
+        memcpy(newptr, oldptr, run->slot_size);
+        ++STATS.realloc_copies;
+        stat_alloc(newptr);
+        stat_free(oldptr);
+        do_free(oldptr);
+        return newptr;
+    }
+
+    asize = ADJUST_SIZE(size);
+    oldsize = GET_SIZE(HDRP(oldptr));
+
+    /* new size fits in the old block, shrink in place */
+    if (asize <= oldsize)
+    {
+        trim(oldptr, asize);
+        ++STATS.realloc_in_place;
+        STATS.in_use -= oldsize - GET_SIZE(HDRP(oldptr));
+        return oldptr;
+    }
+
+    next_bp = NEXT_BLKP(oldptr);
+    next_size = GET_ALLOC(HDRP(next_bp)) ? 0 : GET_SIZE(HDRP(next_bp));
+
+    /* the block is the last one in heap, extend heap for just the missing bytes */
+    if ((oldsize + next_size < asize) && (GET_SIZE(HDRP(NEXT_BLKP(next_size ? next_bp : oldptr))) == 0))
+    {
+        if (extend_heap(MAX(asize - oldsize - next_size, 2 * DSIZE)) == NULL)
+            return NULL;
+        /* the arena may have grown in a chunk away from the block */
+        next_size = GET_ALLOC(HDRP(next_bp)) ? 0 : GET_SIZE(HDRP(next_bp));
+    }
+
+    /* the next block is free and large enough, grow in place */
+    if (oldsize + next_size >= asize)
+    {
+        remove_from_list(next_bp, next_size);
+        PUT(HDRP(oldptr), PACK(oldsize + next_size, GET_PREV_ALLOC(HDRP(oldptr)) | 1));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(oldptr)));
+        trim(oldptr, asize);
+        ++STATS.realloc_in_place;
+        STATS.in_use += GET_SIZE(HDRP(oldptr)) - oldsize;
+        return oldptr;
+    }
+
+    /* have to malloc a new block and copy */
+    newptr = do_malloc(size);
+    if (!newptr)
+        return 0;
+
+    /* copy the old payload */
+    memcpy(newptr, oldptr, oldsize - WSIZE);
+    ++STATS.realloc_copies;
+    stat_alloc(newptr);
+    stat_free(oldptr);
+    /* free old block after copy */
+    do_free(oldptr);
+
+    return newptr;
+}
+
+/*
+ * aligned_lead - return the bytes before the payload aligned to alignment
+ * in free block bp, 0 or enough for a free block of the minimum size
+ */
+static inline size_t aligned_lead(const void *bp, size_t alignment)
+{
+    size_t lead = -(size_t)bp & (alignment - 1);
+
+    return (lead && lead < 2 * DSIZE) ? lead + alignment : lead;
+}
+
+/*
+ * find_aligned - find a free block that holds asize bytes at a payload
+ * aligned to alignment: the first MM_FIT_SCAN blocks from the list of
+ * asize up are tried as they are, then any block that fits with the
+ * largest slack is taken
+ * return NULL if there is none
+ */
+static void *find_aligned(size_t asize, size_t alignment)
+{
+    u_32 list_index = list_index_of(asize);
+    u_32 fl, mask;
+    char *bp;
+    int n = 0;
+
+    for (;;)
+    {
+        /* the next non-empty list from list_index */
+        fl = FL_OF(list_index);
+        mask = SL_BITMAP(fl) & (~0u << SL_OF(list_index));
+        if (!mask)
+        {
+            if (!(FL_BITMAP & (~1u << fl)))
+                break;
+            fl = __builtin_ctz(FL_BITMAP & (~1u << fl));
+            mask = SL_BITMAP(fl);
+        }
+        list_index = fl * SL_NUM + __builtin_ctz(mask);
+        for (bp = B2P(arena->heap_listp, arena->seg_lists[list_index]); bp != NULL;
+             bp = B2P(arena->heap_listp, NEXT_FBP_BIAS(bp)))
+        {
+            if (aligned_lead(bp, alignment) + asize <= GET_SIZE(HDRP(bp)))
+                return bp;
+            if (++n >= MM_FIT_SCAN)
+                return find_fit(asize + alignment + 2 * DSIZE);
+        }
+        if (++list_index == LISTNUM)
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * do_memalign - memalign with the heap lock held, for an alignment
+ * larger than ALIGNMENT: the aligned payload is carved out of a free
+ * block, the slack before it stays in the lists as a free block, and
+ * the bytes after it are split off as place does. The block is never
+ * mapped or a slot, so it is freed as any other
+ */
+static void *do_memalign(size_t alignment, size_t size)
+{
+    size_t asize, bsize, lead, delta;
+    char *bp;
+
+    if (size > MAX_SIZE - alignment - 2 * DSIZE)
+        return NULL;
+    asize = ADJUST_SIZE(size);
+    if ((bp = find_aligned(asize, alignment)) == NULL && FAST_BYTES)
+    {
+        consolidate();
+        bp = find_aligned(asize, alignment);
+    }
+    if (bp == NULL && (bp = extend_heap(MAX(asize + alignment + 2 * DSIZE, CHUNKSIZE))) == NULL)
+        return NULL;
+
+    bsize = GET_SIZE(HDRP(bp));
+    remove_from_list(bp, bsize);
+    if ((lead = aligned_lead(bp, alignment)) > 0)
+    {
+        ++STATS.splits;
+        PUT(HDRP(bp), PACK(lead, GET_PREV_ALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(lead, 0));
+        add_to_list(bp, lead);
+        bp += lead;
+        bsize -= lead;
+        PUT(HDRP(bp), PACK(bsize, 0));
+    }
+
+    delta = bsize - asize;
+    if (delta < (2 * DSIZE))
+    {
+        PUT(HDRP(bp), PACK(bsize, GET_PREV_ALLOC(HDRP(bp)) | 1));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    }
+    else
+    {
+        ++STATS.splits;
+        PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp)) | 1));
+        add_to_list(NEXT_BLKP(bp), delta);
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(delta, PREV_ALLOC));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(delta, 0));
+    }
+    return bp;
+}
+
+/*
+ * carve_blocks - allocate n blocks of asize bytes to ptrs, each free block
+ * taken is split into as many of them as it holds and the rest in a single
+ * pass. A block for all that are left is taken if there's one, else the
+ * fit of one block, as n calls of malloc would fill the holes first
+ * return the number of blocks allocated, fewer than n if the heap can't grow
+ */
+static size_t carve_blocks(size_t asize, size_t n, void **ptrs)
+{
+    size_t i = 0, k, size, delta;
+    char *bp;
+
+    while (i < n)
+    {
+        if ((bp = find_fit(asize * (n - i))) == NULL &&
+            (bp = find_fit(asize)) == NULL && FAST_BYTES)
+        {
+            consolidate();
+            bp = find_fit(asize);
+        }
+        if (bp == NULL && (bp = extend_heap(MAX(asize * (n - i), CHUNKSIZE))) == NULL)
+            break;
+
+        size = GET_SIZE(HDRP(bp));
+        k = MIN(n - i, size / asize);
+        delta = size - asize * k;
+        remove_from_list(bp, size);
+        PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp)) | 1));
+        ptrs[i++] = bp;
+        while (--k > 0)
+        {
+            bp += asize;
+            PUT(HDRP(bp), PACK(asize, PREV_ALLOC | 1));
+            ptrs[i++] = bp;
+            ++STATS.splits;
+        }
+
+        /* the last block takes the rest if it's too small to be free */
+        if (delta < (2 * DSIZE))
+        {
+            PUT(HDRP(bp), PACK(asize + delta, GET_PREV_ALLOC(HDRP(bp)) | 1));
+            SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+        }
+        else
+        {
+            ++STATS.splits;
+            bp += asize;
+            add_to_list(bp, delta);
+            PUT(HDRP(bp), PACK(delta, PREV_ALLOC));
+            PUT(FTRP(bp), PACK(delta, 0));
+        }
+    }
+    return i;
+}
+
+/*
+ * sift_ptr - move ptrs[k] down the max-heap of the first n pointers
+ */
+static inline void sift_ptr(void **ptrs, size_t k, size_t n)
+{
+    void *p = ptrs[k];
+    size_t child;
+
+    while ((child = 2 * k + 1) < n)
+    {
+        if (child + 1 < n && (uintptr_t)ptrs[child + 1] > (uintptr_t)ptrs[child])
+            ++child;
+        if ((uintptr_t)ptrs[child] <= (uintptr_t)p)
+            break;
+        ptrs[k] = ptrs[child];
+        k = child;
+    }
+    ptrs[k] = p;
+}
+
+/*
+ * sort_ptrs - sort n pointers by address in place, with a heapsort
+ * unless they are in order already, as the blocks of a batch often are
+ */
+static void sort_ptrs(void **ptrs, size_t n)
+{
+    size_t i;
+    void *p;
+
+    for (i = 1; i < n && (uintptr_t)ptrs[i - 1] <= (uintptr_t)ptrs[i]; ++i)
+        ;
+    if (i >= n)
+        return;
+    for (i = n / 2; i-- > 0;)
+        sift_ptr(ptrs, i, n);
+    for (i = n - 1; i > 0; --i)
+    {
+        p = ptrs[i];
+        ptrs[i] = ptrs[0];
+        ptrs[0] = p;
+        sift_ptr(ptrs, 0, i);
+    }
+}
+
+/*
+ * Return whether the pointer is in the heap.
+ * May be useful for debugging.
+ */
+static int in_heap(const void *p)
+{
+    return p <= mem_heap_hi() && p >= mem_heap_lo();
+}
+
+/*
+ * Return whether the pointer is aligned.
+ * May be useful for debugging.
+ */
+static int aligned(const void *p)
+{
+    return (size_t)ALIGN(p) == (size_t)p;
+}
+
+/*
+ * stat_class - compute the class of the counters for size bytes
+ */
+static inline u_32 stat_class(size_t size)
+{
+    u_32 log2 = 8 * sizeof(long) - 1 - __builtin_clzl(size);
+
+    return MIN(log2, MM_STATS_CLASSES - 1);
+}
+
+/*
+ * block_size - return the size of allocated block bp in the heap,
+ * the slot size if it's a slot
+ */
+static inline size_t block_size(const void *bp)
+{
+    run_t *run = run_of(bp);
+
+    return (run != NULL) ? run->slot_size : GET_SIZE(HDRP(bp));
+}
+
+/*
+ * stat_alloc - count block bp given to the program, with the lock of
+ * the current arena held, mapped blocks are counted by map_block
+ */
+static void stat_alloc(void *bp)
+{
+    size_t size;
+
+    if (IS_MAPPED(bp))
+        return;
+    size = block_size(bp);
+    ++STATS.mallocs[stat_class(size)];
+    STATS.in_use += size;
+}
+
+/*
+ * stat_free - count block bp given back by the program, before it's freed
+ */
+static void stat_free(void *bp)
+{
+    size_t size = block_size(bp);
+
+    ++STATS.frees[stat_class(size)];
+    STATS.in_use -= size;
+}
+
+/*
+ * mm_checkheap - check correctness of every arena
+ * no other call may run at the same time
+ */
+void mm_checkheap(int lineno)
+{
+    arena_t *current = arena;
+
+    for (int i = 0; i < MM_ARENAS; ++i)
+    {
+        if (arenas[i] == NULL)
+            continue;
+        arena = arenas[i];
+        check_arena(lineno);
+    }
+    arena = current;
+}
+
+/*
+ * mm_stats - sum up the counters of every arena, and count the blocks
+ * in the free lists of each. With MM_THREADS, a block counts when it
+ * moves between an arena and a thread cache, so the blocks in the
+ * caches count as in use
+ */
+void mm_stats(mm_stats_t *stats)
+{
+    arena_t *current = arena;
+    mm_stats_t *s;
+    char *bp;
+
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < MM_ARENAS; ++i)
+    {
+        if (arenas[i] == NULL)
+            continue;
+        LOCK(arenas[i]);
+        arena = arenas[i];
+        s = &arena_stats[i];
+        for (int c = 0; c < MM_STATS_CLASSES; ++c)
+        {
+            stats->mallocs[c] += s->mallocs[c];
+            stats->frees[c] += s->frees[c];
+        }
+        stats->splits += s->splits;
+        stats->coalesces += s->coalesces;
+        stats->extends += s->extends;
+        stats->trims += s->trims;
+        stats->realloc_in_place += s->realloc_in_place;
+        stats->realloc_copies += s->realloc_copies;
+        stats->recent_hits += s->recent_hits;
+        stats->in_use += s->in_use;
+
+        for (int j = 0; j < LISTNUM; ++j)
+        {
+            for (bp = B2P(arena->heap_listp, arena->seg_lists[j]); bp != NULL;
+                 bp = B2P(arena->heap_listp, NEXT_FBP_BIAS(bp)))
+            {
+                ++stats->free_blocks[stat_class(GET_SIZE(HDRP(bp)))];
+                stats->free_bytes += GET_SIZE(HDRP(bp));
+            }
+        }
+        stats->free_bytes += FAST_BYTES;
+        UNLOCK(arenas[i]);
+    }
+    stats->maps = __atomic_load_n(&map_count, __ATOMIC_RELAXED);
+    stats->unmaps = __atomic_load_n(&unmap_count, __ATOMIC_RELAXED);
+    stats->in_use += __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+    stats->heap_size = mem_heapsize() + __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+    arena = current;
+}
+
+/*
+ * mm_heap_snapshot - write the blocks of every arena in address order,
+ * as [offset from the start of heap, size, state], state is "a" for an
+ * allocated block, "f" for a free one, and "r" for a slab run, followed
+ * by its slot size and number of free slots. Blocks in fastbins and
+ * thread caches are allocated, and mapped blocks are not in the heap
+ */
+void mm_heap_snapshot(FILE *out)
+{
+    arena_t *current = arena;
+    char *lo = mem_heap_lo();
+    char *bp;
+    run_t *run;
+    int first = 1;
+
+    fprintf(out, "{\"heap_lo\": \"%p\", \"heap_size\": %lu, \"arenas\": [",
+            (void *)lo, (unsigned long)mem_heapsize());
+    for (int i = 0; i < MM_ARENAS; ++i)
+    {
+        if (arenas[i] == NULL)
+            continue;
+        LOCK(arenas[i]);
+        arena = arenas[i];
+        fprintf(out, "%s\n{\"id\": %d, \"blocks\": [", first ? "" : ",", i);
+        first = 0;
+        for (bp = NEXT_BLKP(arena->heap_listp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp))
+        {
+            fprintf(out, "%s\n[%lu,%lu,", (bp == NEXT_BLKP(arena->heap_listp)) ? "" : ",",
+                    (unsigned long)(bp - lo), (unsigned long)GET_SIZE(HDRP(bp)));
+            if (!GET_ALLOC(HDRP(bp)))
+                fprintf(out, "\"f\"]");
+            else if ((run = run_of(bp)) != NULL && (char *)run == bp)
+                fprintf(out, "\"r\",%d,%d]", run->slot_size, run->nfree);
+            else
+                fprintf(out, "\"a\"]");
+        }
+        fprintf(out, "\n]}");
+        UNLOCK(arenas[i]);
+    }
+    fprintf(out, "\n]}\n");
+    arena = current;
+}
+
+/*
+ * check_arena - check correctness of the current arena
+ * first check gloable pointers
+ * then check the blocks in heap -- The header and footer, the previous allocated bit, the alignment, and in_heap check
+ * finally check the list -- neighbour free blocks should be coalesced and size should fit the list
+ */
+static void check_arena(int lineno)
+{
+    /* first check gloable pointers, nothing else can be checked without them */
+    if (arena->heap_listp == NULL || arena->seg_lists == NULL)
+    {
+        check_error(lineno, NULL, "heap not initialized");
+        return;
+    }
 
     /* then check the heap */
-    void *heap_bp = heap_listp;
-    while (GET_SIZE(HDRP(heap_bp)) || !GET_ALLOC(HDRP(heap_bp)))
+    void *heap_bp = NEXT_BLKP(arena->heap_listp);
+    int prev_alloc = 1; /* the prologue */
+    int alloc;
+    size_t blocks = 0;
+    while (1)
+    {
+        /* hearder should be consistent with the previous block */
+        if (!GET_PREV_ALLOC(HDRP(heap_bp)) != !prev_alloc)
+            check_error(lineno, heap_bp, "wrong previous allocated bit");
+        if (!GET_SIZE(HDRP(heap_bp)) && GET_ALLOC(HDRP(heap_bp))) /* the epilogue */
+            break;
+        alloc = GET_ALLOC(HDRP(heap_bp));
+
+        /* the walk can't go on past a broken size */
+        if (!GET_SIZE(HDRP(heap_bp)) || NEXT_BLKP(heap_bp) > arena->top)
+        {
+            check_error(lineno, heap_bp, "bad block size");
+            break;
+        }
+        ++blocks;
+
+        /* hearder should be consistent with footer for free block */
+        if (!alloc && (GET_SIZE(HDRP(heap_bp)) != GET_SIZE(FTRP(heap_bp))))
+            check_error(lineno, heap_bp, "different size in header and footer");
+        if (!alloc && GET_ALLOC(FTRP(heap_bp)))
+            check_error(lineno, heap_bp, "different alloc bit in header and footer");
+
+        /* block should be aligned */
+        if (!aligned(heap_bp))
+            check_error(lineno, heap_bp, "block not aligned");
+
+        /* block should be in the heap */
+        if (!in_heap(heap_bp))
+            check_error(lineno, heap_bp, "block not in heap");
+        prev_alloc = alloc;
+        heap_bp = NEXT_BLKP(heap_bp);
+    }
+
+    /* finally check every lists */
+    for (int list_index = 0; list_index < LISTNUM; ++list_index)
+    {
+        void *free_bp = B2P(arena->heap_listp, arena->seg_lists[list_index]);
+
+        /* bitmaps should be consistent with the list */
+        if (!(SL_BITMAP(FL_OF(list_index)) & (1u << SL_OF(list_index))) != (free_bp == NULL))
+            check_error(lineno, free_bp, "bitmap inconsistent with list");
+        if (!(FL_BITMAP & (1u << FL_OF(list_index))) != !SL_BITMAP(FL_OF(list_index)))
+            check_error(lineno, NULL, "first level bitmap inconsistent");
+
+        void *prev_bp = NULL;
+        size_t nodes = 0;
+        while (free_bp != NULL)
+        {
+            /* a list can't have more nodes than there are blocks */
+            if (!in_heap(free_bp) || ++nodes > blocks)
+            {
+                check_error(lineno, free_bp, "list broken or looped");
+                break;
+            }
+            if (B2P(arena->heap_listp, PREV_FBP_BIAS(free_bp)) != prev_bp)
+                check_error(lineno, free_bp, "wrong previous node in list");
+
+            /* the list should be in the order of MM_FIT_POLICY */
+            if (prev_bp != NULL && LIST_AFTER(free_bp, prev_bp, GET_SIZE(HDRP(prev_bp))))
+                check_error(lineno, free_bp, "list out of order");
+
+            /* first check if theres uncoalesced blocks */
+            if (!GET_PREV_ALLOC(HDRP(free_bp)) || !GET_ALLOC(HDRP(NEXT_BLKP(free_bp))))
+                check_error(lineno, free_bp, "free block not coalesced");
+
+            /* then check if the size fits */
+            size_t size = GET_SIZE(HDRP(free_bp));
+            if (list_index_of(size) != (u_32)list_index)
+                check_error(lineno, free_bp, "block in wrong list");
+            prev_bp = free_bp;
+            free_bp = B2P(arena->heap_listp, NEXT_FBP_BIAS(free_bp));
+        }
+    }
+    /* check the fastbins, their blocks are allocated for the heap */
+    size_t fast_bytes = 0;
+    for (int i = 0; i < FAST_NUM; ++i)
+    {
+        char *fast_bp = B2P(arena->heap_listp, FAST_LISTS[i]);
+
+        for (; fast_bp != NULL; fast_bp = B2P(arena->heap_listp, GET(fast_bp)))
+        {
+            if (!in_heap(fast_bp) || !GET_ALLOC(HDRP(fast_bp)))
+            {
+                check_error(lineno, fast_bp, "bad block in fastbin");
+                break;
+            }
+            if (FAST_INDEX(GET_SIZE(HDRP(fast_bp))) != (size_t)i)
+                check_error(lineno, fast_bp, "block in wrong fastbin");
+            fast_bytes += GET_SIZE(HDRP(fast_bp));
+        }
+    }
+    if (fast_bytes != FAST_BYTES)
+        check_error(lineno, NULL, "wrong bytes in fastbins");
+#if MM_RECENT
+    /* a recent block is a free block of its first level, a recent slot a free slot */
+    for (int fl = 0; fl < MM_FL_NUM; ++fl)
+    {
+        char *recent_bp = B2P(arena->heap_listp, RECENT_LISTS[fl]);
+
+        if (recent_bp != NULL && (!in_heap(recent_bp) || GET_ALLOC(HDRP(recent_bp)) ||
+                                  FL_OF(list_index_of(GET_SIZE(HDRP(recent_bp)))) != (u_32)fl))
+            check_error(lineno, recent_bp, "bad recent block");
+    }
+    for (int slab_index = 0; slab_index < SLAB_NUM; ++slab_index)
+    {
+        char *recent_bp = B2P(arena->heap_listp, RECENT_SLOTS[slab_index]);
+        run_t *run;
+        int slot;
+
+        if (recent_bp == NULL)
+            continue;
+        if ((run = run_of(recent_bp)) == NULL || run->slot_size != (slab_index + 1) * ALIGNMENT ||
+            (slot = (recent_bp - RUN_SLOT(run, 0)) / run->slot_size,
+             !(run->free_map[slot >> 5] & (1u << (slot & 31)))))
+            check_error(lineno, recent_bp, "bad recent slot");
+    }
+#endif
+    /* check the runs of every size */
+    for (int slab_index = 0; slab_index < SLAB_NUM; ++slab_index)
+    {
+        run_t *run = (run_t *)B2P(arena->heap_listp, RUN_LISTS[slab_index]);
+
+        while (run != NULL)
+        {
+            if (run->slot_size != (slab_index + 1) * ALIGNMENT)
+                check_error(lineno, run, "run in wrong list");
+            if (!run->nfree)
+                check_error(lineno, run, "wrong number of free slots");
+            check_run(run, lineno);
+            run = (run_t *)B2P(arena->heap_listp, run->next);
+        }
+    }
+}
+
+/*
+ * check_error - report an error of the heap found by a check for the
+ * call at lineno, without malloc or stdio, which may be this allocator
+ */
+static void check_error(int lineno, const void *p, const char *msg)
+{
+    char line[128];
+    int len;
+
+    if (__atomic_add_fetch(&check_errors, 1, __ATOMIC_RELAXED) > MM_CHECK_REPORTS)
+        return;
+    len = snprintf(line, sizeof(line), "mm: line %d: %s at %p\n", lineno, msg, p);
+    write(STDERR_FILENO, line, MIN((size_t)len, sizeof(line) - 1));
+}
+
+/*
+ * check_block - check block bp of the current arena, the blocks next to
+ * it, and the list nodes of the free ones among them
+ */
+static void check_block(void *bp, int lineno)
+{
+    char *prev_bp, *next_bp;
+    int alloc;
+
+    if (!in_heap(bp) || !aligned(bp))
+    {
+        check_error(lineno, bp, "block not in heap");
+        return;
+    }
+    next_bp = NEXT_BLKP(bp);
+    if (!GET_SIZE(HDRP(bp)) || next_bp > arena->top)
+    {
+        check_error(lineno, bp, "bad block size");
+        return;
+    }
+    alloc = GET_ALLOC(HDRP(bp));
+    if (!GET_PREV_ALLOC(HDRP(next_bp)) != !alloc)
+        check_error(lineno, next_bp, "wrong previous allocated bit");
+
+    /* the block before is known only if it is free */
+    if (!GET_PREV_ALLOC(HDRP(bp)))
+    {
+        prev_bp = PREV_BLKP(bp);
+        if (!in_heap(prev_bp) || prev_bp <= arena->heap_listp || NEXT_BLKP(prev_bp) != bp)
+            check_error(lineno, bp, "bad footer of the block before");
+        else if (!alloc)
+            check_error(lineno, bp, "free block not coalesced");
+        else
+            check_node(prev_bp, lineno);
+    }
+    if (!alloc)
+        check_node(bp, lineno);
+    if (GET_SIZE(HDRP(next_bp)) && !GET_ALLOC(HDRP(next_bp)))
+    {
+        if (!alloc)
+            check_error(lineno, bp, "free block not coalesced");
+        else if (NEXT_BLKP(next_bp) <= arena->top)
+            check_node(next_bp, lineno);
+    }
+}
+
+/*
+ * check_node - check free block bp of the current arena, its footer, and
+ * its links with the nodes before and after it in its list
+ */
+static void check_node(void *bp, int lineno)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    u_32 list_index = list_index_of(size);
+    char *prev_bp = B2P(arena->heap_listp, PREV_FBP_BIAS(bp));
+    char *next_bp = B2P(arena->heap_listp, NEXT_FBP_BIAS(bp));
+
+    if (size != GET_SIZE(FTRP(bp)))
+        check_error(lineno, bp, "different size in header and footer");
+    if (GET_ALLOC(FTRP(bp)))
+        check_error(lineno, bp, "different alloc bit in header and footer");
+    if (!(SL_BITMAP(FL_OF(list_index)) & (1u << SL_OF(list_index))) ||
+        !(FL_BITMAP & (1u << FL_OF(list_index))))
+        check_error(lineno, bp, "bitmap inconsistent with list");
+
+    if (prev_bp == NULL)
+    {
+        if (B2P(arena->heap_listp, arena->seg_lists[list_index]) != (char *)bp)
+            check_error(lineno, bp, "block in wrong list");
+    }
+    else if (!in_heap(prev_bp) || B2P(arena->heap_listp, NEXT_FBP_BIAS(prev_bp)) != (char *)bp)
+        check_error(lineno, bp, "wrong previous node in list");
+    else if (list_index_of(GET_SIZE(HDRP(prev_bp))) != list_index)
+        check_error(lineno, prev_bp, "block in wrong list");
+    else if (LIST_AFTER(bp, prev_bp, GET_SIZE(HDRP(prev_bp))))
+        check_error(lineno, bp, "list out of order");
+
+    if (next_bp == NULL)
+        return;
+    if (!in_heap(next_bp) || B2P(arena->heap_listp, PREV_FBP_BIAS(next_bp)) != (char *)bp)
+        check_error(lineno, next_bp, "wrong previous node in list");
+    else if (list_index_of(GET_SIZE(HDRP(next_bp))) != list_index)
+        check_error(lineno, next_bp, "block in wrong list");
+    else if (LIST_AFTER(next_bp, bp, size))
+        check_error(lineno, next_bp, "list out of order");
+}
+
+/*
+ * check_run - check the run head and the free slots of run
+ */
+static void check_run(run_t *run, int lineno)
+{
+    int nfree = 0;
+
+    for (int i = 0; i < RUN_MAP_WORDS; ++i)
+        nfree += __builtin_popcount(run->free_map[i]);
+
+    if (run_of(RUN_SLOT(run, 0)) != run)
+        check_error(lineno, run, "run not in page bitmap");
+    if (run->slot_size < ALIGNMENT || run->slot_size > MM_SLAB_MAX || run->slot_size % ALIGNMENT)
+        check_error(lineno, run, "run in wrong list");
+    else if (run->nfree != nfree || nfree > (int)RUN_SLOTS(run->slot_size))
+        check_error(lineno, run, "wrong number of free slots");
+}
+
+/*
+ * check_freeing - return the block that bp will be part of once it's
+ * freed, to be checked by check_touched after the free: bp, the free block
+ * before it that it is coalesced with, or the one of its run if it's the
+ * last slot in use. Return NULL if it can't be told, when the free empties
+ * the fastbins to the lists
+ */
+static void *check_freeing(void *bp)
+{
+    run_t *run;
+
+    if (bp == NULL || IS_MAPPED(bp))
+        return NULL;
+    if ((run = run_of(bp)) != NULL)
+    {
+        if ((size_t)run->nfree + 1 < RUN_SLOTS(run->slot_size) || !(run->prev || run->next))
+            return bp;
+        bp = run;
+    }
+#if MM_FASTBIN_MAX > 0
+    else if (GET_SIZE(HDRP(bp)) <= MM_FASTBIN_MAX)
+        return (FAST_BYTES + GET_SIZE(HDRP(bp)) >= MM_FASTBIN_LIMIT) ? NULL : bp;
+#endif
+    return GET_PREV_ALLOC(HDRP(bp)) ? bp : PREV_BLKP(bp);
+}
+
+/*
+ * check_touched - check block bp of the current arena that a call has
+ * just allocated or freed, or the run of it if it's a slot
+ */
+static void check_touched(void *bp, int lineno)
+{
+    run_t *run;
+
+    if (bp == NULL || IS_MAPPED(bp))
+        return;
+    if ((run = run_of(bp)) != NULL)
+        check_run(run, lineno);
+    else
+        check_block(bp, lineno);
+}
+
+/*
+ * check_call - the checks at the end of a call of the current arena:
+ * block bp it touched, NULL for none, and the whole arena if it's the
+ * MM_CHECK_EVERY-th call since the last time
+ */
+static void check_call(void *bp, int lineno)
+{
+    check_touched(bp, lineno);
+#if MM_CHECK_EVERY > 0
+    if (++check_calls[arena->id] >= MM_CHECK_EVERY)
+    {
+        check_calls[arena->id] = 0;
+        check_arena(lineno);
+    }
+#endif
+}
+
+/*
+ * arena_new - create arena id with its lists, prologue and epilogue,
+ * and a first free block of CHUNKSIZE bytes
+ * return NULL if failed
+ */
+static arena_t *arena_new(int id)
+{
+    size_t head = ALIGN(sizeof(arena_t)) + (META_WORDS + 3) * WSIZE;
+    size_t chunk_size = head;
+    char *p;
+    arena_t *a;
+
+#if MM_ARENAS > 1
+    chunk_size = head + CHUNKSIZE + ALIGNMENT;
+    if ((p = mem_sbrk_owner(chunk_size, id)) == (void *)-1)
+        return NULL;
+#else
+    if ((p = mem_sbrk(chunk_size)) == (void *)-1)
+        return NULL;
+#endif
+    a = (arena_t *)p;
+    p += ALIGN(sizeof(arena_t));
+    /*initialize the array of bias of lists' first nodes, and the bitmaps*/
+    for (int i = 0; i < META_WORDS; ++i)
+        PUT(p + (i * WSIZE), 0);
+    /* Prologue and Epilogue */
+    PUT(p + (META_WORDS * WSIZE), PACK(DSIZE, 1));
+    PUT(p + ((META_WORDS + 1) * WSIZE), PACK(DSIZE, 1));
+    PUT(p + ((META_WORDS + 2) * WSIZE), PACK(0, PREV_ALLOC | 1));
+
+    a->seg_lists = (word_t *)p;
+    a->heap_listp = p + ((META_WORDS + 1) * WSIZE);
+    a->top = (char *)a + head;
+    a->end = (char *)a + chunk_size;
+    a->id = id;
+    a->trim_threshold = MM_TRIM_THRESHOLD;
+    a->trimmed = 0;
+#ifdef MM_THREADS
+    pthread_mutex_init(&a->lock, NULL);
+    a->remote = NULL;
+#endif
+
+    arena = a;
+    if (extend_heap(CHUNKSIZE) == NULL)
+        return NULL;
+    return a;
+}
+
+/*
+ * arena_of - return the arena that owns block bp
+ */
+static inline arena_t *arena_of(const void *bp)
+{
+#if MM_ARENAS > 1
+    return arenas[mem_owner(bp)];
+#else
+    return arenas[0];
+#endif
+}
+
+/*
+ * thread_arena - return the arena of this thread, create it if needed
+ * return NULL if failed
+ */
+static arena_t *thread_arena(void)
+{
+    arena_t *a;
+    int index = 0;
+
+    if (arenas[0] == NULL && mm_init() == -1)
+        return NULL;
+#ifdef MM_THREADS
+#ifdef MM_ARENA_BY_CPU
+    index = many_threads() ? sched_getcpu() : 0;
+    index = (index < 0) ? 0 : index % MM_ARENAS;
+#else
+    if (arena_index < 0)
+        arena_index = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % MM_ARENAS;
+    index = arena_index;
+#endif
+    if ((a = __atomic_load_n(&arenas[index], __ATOMIC_ACQUIRE)) == NULL)
+    {
+        pthread_mutex_lock(&arenas_lock);
+        if ((a = arenas[index]) == NULL && (a = arena_new(index)) != NULL)
+            __atomic_store_n(&arenas[index], a, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&arenas_lock);
+        /* fall back to the first arena if out of memory */
+        if (a == NULL)
+            a = arenas[0];
+    }
+#else
+    a = arenas[index];
+#endif
+    return a;
+}
+
+/*
+ * arena_sbrk - extend the heap of the current arena by size bytes,
+ * return the old top like mem_sbrk, or (void *)-1 if failed
+ * with many arenas, memlib may give the arena a chunk that is not right
+ * after it, then the gap from the epilogue to the chunk becomes an
+ * allocated block, so every chunk is taken with ALIGNMENT more bytes for
+ * its header, and the bytes not used are kept after the top
+ */
+static void *arena_sbrk(size_t size)
+{
+    char *bp = arena->top;
+#if MM_ARENAS > 1
+    size_t chunk_size;
+    char *chunk;
+
+    if (bp + size > arena->end)
+    {
+        chunk_size = size + ALIGNMENT;
+        if ((chunk = mem_sbrk_owner(chunk_size, arena->id)) == (void *)-1)
+            return (void *)-1;
+        if (chunk != arena->end)
+        {
+            PUT(HDRP(bp), PACK(chunk + ALIGNMENT - bp, GET_PREV_ALLOC(HDRP(bp)) | 1));
+            bp = chunk + ALIGNMENT;
+            PUT(HDRP(bp), PACK(0, PREV_ALLOC | 1));
+        }
+        arena->end = chunk + chunk_size;
+    }
+#else
+    if (mem_sbrk(size) == (void *)-1)
+        return (void *)-1;
+#endif
+    arena->top = bp + size;
+    return bp;
+}
+
+/*
+ * map_block - allocate a block of size bytes in a mapped region
+ * return NULL if failed
+ */
+static void *map_block(size_t size)
+{
+    size_t page = mem_pagesize();
+    size_t region_size = (size + ALIGNMENT + page - 1) & ~(page - 1);
+    char *region;
+
+    if ((region = mem_map(region_size)) == (void *)-1)
+        return NULL;
+    PUT(region + ALIGNMENT - WSIZE, PACK(region_size, 1));
+    ATOMIC_ADD(map_count, 1);
+    ATOMIC_ADD(mapped_bytes, region_size);
+    return region + ALIGNMENT;
+}
+
+/*
+ * unmap_block - unmap the region of mapped block bp
+ */
+static void unmap_block(void *bp)
+{
+    ATOMIC_ADD(unmap_count, 1);
+    ATOMIC_ADD(mapped_bytes, -(size_t)GET_SIZE(HDRP(bp)));
+    mem_unmap((char *)bp - ALIGNMENT);
+}
+
+/*
+ * remap_block - realloc of mapped block oldptr, done in place if the
+ * region is large enough, otherwise by malloc and copy
+ * return NULL if failed
+ */
+static void *remap_block(void *oldptr, size_t size)
+{
+    size_t old_size = GET_SIZE(HDRP(oldptr)) - ALIGNMENT;
+    void *newptr;
+
+    if (size == 0)
+    {
+        unmap_block(oldptr);
+        return NULL;
+    }
+#if MM_MMAP_THRESHOLD > 0
+    /* stay in the region unless it becomes small */
+    if (size <= old_size && size >= MM_MMAP_THRESHOLD)
+        return oldptr;
+#endif
+    if ((newptr = malloc(size)) == NULL)
+        return NULL;
+    memcpy(newptr, oldptr, MIN(size, old_size));
+    unmap_block(oldptr);
+    return newptr;
+}
+
+/*
+ * trim_heap - shrink the heap of the current arena, given bp the large
+ * free block at its end, and keep CHUNKSIZE bytes of it at least
+ * the heap is not shrunk if memlib has given the memory after the
+ * arena to another one
+ */
+static void trim_heap(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    size_t release = (size > CHUNKSIZE) ? (size - CHUNKSIZE) & ~(size_t)(CHUNKSIZE - 1) : 0;
+
+    if (release == 0)
+        return;
+
+#if MM_ARENAS > 1
+    if (mem_sbrk_owner(-(intptr_t)(release + (arena->end - arena->top)), arena->id) == (void *)-1)
+        return;
+    arena->end = arena->top - release;
+#else
+    if (mem_sbrk(-(intptr_t)release) == (void *)-1)
+        return;
+#endif
+    arena->top -= release;
+    arena->trimmed = release;
+    ++STATS.trims;
+
+    remove_from_list(bp, size);
+    size -= release;
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+    PUT(FTRP(bp), PACK(size, 0));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
+    add_to_list(bp, size);
+}
+
+/*
+ * extend_heap - extend heap of at least size bytes
+ * return pointer to block
+ */
+static void *extend_heap(size_t size)
+{
+    char *bp;
+    size_t asize = ALIGN(size);
+
+    /* extend the heap */
+    if ((long)(bp = arena_sbrk(asize)) == -1)
+        return NULL;
+    ++STATS.extends;
+#if MM_TRIM_THRESHOLD > 0
+    /* the memory of the last trim is wanted again, trim less often */
+    if (arena->trimmed)
+    {
+        arena->trim_threshold = MIN(MAX(arena->trim_threshold, 2 * arena->trimmed), MM_TRIM_MAX);
+        arena->trimmed = 0;
+    }
+#endif
+
+    /* initialize free block header/footer and the epilogue header */
+
+    PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp))));
+    PUT(FTRP(bp), PACK(asize, 0));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
+    /* add the new block to the list */
+    add_to_list(bp, asize);
+
+    /* coalesce if the previous block was free */
+    return coalesce(bp);
+}
+
+/*
+ * coalesce - coalesce according to tag bit. 
+ * Return ptr to coalesced block
+ */
+static void *coalesce(void *bp)
+{
+    short prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    short next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    size_t asize = GET_SIZE(HDRP(bp));
+    size_t next_size, prev_size;
+
+    if (prev_alloc && next_alloc)
+        return bp;
+    else if (prev_alloc && !next_alloc) /* just coalesce the next block */
+    {
+        next_size = GET_SIZE(HDRP(NEXT_BLKP(bp)));
+
+        remove_from_list(bp, asize);
+        remove_from_list(NEXT_BLKP(bp), next_size);
+        asize += next_size;
+        ++STATS.coalesces;
+        PUT(HDRP(bp), PACK(asize, PREV_ALLOC));
+        PUT(FTRP(bp), PACK(asize, 0));
+    }
+    else if (!prev_alloc && next_alloc) /* just coalesce the prev block */
+    {
+        prev_size = GET_SIZE(HDRP(PREV_BLKP(bp)));
+
+        remove_from_list(bp, asize);
+        remove_from_list(PREV_BLKP(bp), prev_size);
+        asize += prev_size;
+        ++STATS.coalesces;
+        bp = PREV_BLKP(bp);
+        PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(asize, 0));
+    }
+    else /* coalesce both the prev and next block */
+    {
+        next_size = GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        prev_size = GET_SIZE(HDRP(PREV_BLKP(bp)));
+        remove_from_list(bp, asize);
+        remove_from_list(PREV_BLKP(bp), prev_size);
+        remove_from_list(NEXT_BLKP(bp), next_size);
+        asize += (next_size + prev_size);
+        STATS.coalesces += 2;
+        bp = PREV_BLKP(bp);
+        PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(asize, 0));
+    }
+    add_to_list(bp, asize);
+    return bp;
+}
+
+/* 
+ * place - given free block pointer bp, allocate at least size bytes
+ * split a new free block if block_size - size > 16
+ */
+static void *place(void *bp, size_t size)
+{
+    size_t blk_size = GET_SIZE(HDRP(bp));
+    size_t delta = blk_size - size;
+
+    remove_from_list(bp, blk_size);
+
+    if (delta < (2 * DSIZE))
+    {
+        PUT(HDRP(bp), PACK(blk_size, GET_PREV_ALLOC(HDRP(bp)) | 1));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    }
+    else
+    {
+        ++STATS.splits;
+        PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)) | 1));
+        add_to_list(NEXT_BLKP(bp), delta);
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(delta, PREV_ALLOC));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(delta, 0));
+    }
+    return bp;
+}
+
+/*
+ * trim - shrink allocated block bp to asize bytes
+ * split the tail as a new free block if it is at least 16 bytes,
+ * and coalesce it with the next block
+ */
+static void trim(void *bp, size_t asize)
+{
+    size_t blk_size = GET_SIZE(HDRP(bp));
+    size_t delta = blk_size - asize;
+
+    if (delta < (2 * DSIZE))
+        return;
+
+    ++STATS.splits;
+    PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp)) | 1));
+    bp = NEXT_BLKP(bp);
+    PUT(HDRP(bp), PACK(delta, PREV_ALLOC));
+    PUT(FTRP(bp), PACK(delta, 0));
+    CLEAR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    add_to_list(bp, delta);
+    coalesce(bp);
+}
+
+/*
+ * find_fit - find a free block of at least asize bytes in the lists
+ * return NULL if there's no such block
+ */
+static void *find_fit(size_t asize)
+{
+    char *bp = NULL;
+    u_32 list_index; // which list?
+    u_32 fl, mask;   // first level and its non-empty lists that fit
+#if MM_FIT_POLICY == MM_FIT_GOOD
+    char *best = NULL, *rest = NULL; // best fit so far, and where the scan stopped
+#endif
+
+    /* search fit free block in the list of asize itself */
+    list_index = list_index_of(asize);
+#if MM_RECENT
+    /* the block last freed, while it's warm */
+    bp = B2P(arena->heap_listp, RECENT_LISTS[FL_OF(list_index)]);
+    if (bp != NULL && asize <= GET_SIZE(HDRP(bp)) && GET_SIZE(HDRP(bp)) - asize < 2 * DSIZE)
+    {
+        ++STATS.recent_hits;
+        return bp;
+    }
+    bp = NULL;
+#endif
+    fl = FL_OF(list_index);
+    if (SL_BITMAP(fl) & (1u << SL_OF(list_index)))
     {
-        /* hearder should be consistent with footer*/
-        if (GET_SIZE(HDRP(heap_bp)) != GET_SIZE(FTRP(heap_bp)))
+        bp = B2P(arena->heap_listp, arena->seg_lists[list_index]);
+#if MM_FIT_POLICY == MM_FIT_GOOD
+        /* scan the first MM_FIT_SCAN blocks only, stop at an exact fit */
+        for (int n = 0; bp != NULL && n < MM_FIT_SCAN; ++n)
         {
-            dbg_printf("line %d: different size in header and footer\n", lineno);
-            error_found = 1;
+            if (asize <= GET_SIZE(HDRP(bp)) && (best == NULL || GET_SIZE(HDRP(bp)) < GET_SIZE(HDRP(best))))
+                best = bp;
+            bp = B2P(arena->heap_listp, NEXT_FBP_BIAS(bp));
+            if (best != NULL && GET_SIZE(HDRP(best)) == asize)
+                break;
         }
-        if (GET_ALLOC(HDRP(heap_bp)) != GET_ALLOC(FTRP(heap_bp)))
+        rest = bp;
+        bp = best;
+#else
+        while ((bp != NULL) && ((asize > GET_SIZE(HDRP(bp)))))
+            bp = B2P(arena->heap_listp, NEXT_FBP_BIAS(bp));
+#endif
+    }
+
+    /* any block in a larger list fits, take the first node of the first one */
+    if (bp == NULL)
+    {
+        mask = SL_BITMAP(fl) & (~1u << SL_OF(list_index));
+        if (!mask && (FL_BITMAP & (~1u << fl)))
         {
-            dbg_printf("line %d: different alloc bit in header and footer\n", lineno);
-            error_found = 1;
+            fl = __builtin_ctz(FL_BITMAP & (~1u << fl));
+            mask = SL_BITMAP(fl);
         }
+        if (mask)
+            bp = B2P(arena->heap_listp, arena->seg_lists[fl * SL_NUM + __builtin_ctz(mask)]);
+    }
+#if MM_FIT_POLICY == MM_FIT_GOOD
+    /* no larger block, take the first fit after the scanned blocks */
+    while ((bp == NULL) && (rest != NULL))
+    {
+        if (asize <= GET_SIZE(HDRP(rest)))
+            bp = rest;
+        rest = B2P(arena->heap_listp, NEXT_FBP_BIAS(rest));
+    }
+#endif
+    return bp;
+}
+
+/*
+ * alloc_block - allocate a block of asize bytes from the lists,
+ * extend the heap if no block fits
+ * return NULL if failed
+ */
+static void *alloc_block(size_t asize)
+{
+    char *bp = find_fit(asize);
+
+    /* coalesce the blocks in fastbins, and try again */
+    if (bp == NULL && FAST_BYTES)
+    {
+        consolidate();
+        bp = find_fit(asize);
+    }
+
+    /* have to extend heap */
+    if (bp == NULL)
+    {
+        if ((bp = extend_heap(MAX(asize, CHUNKSIZE))) == NULL)
+            return NULL;
+    }
+    /* place the block */
+    return place(bp, asize);
+}
 
-        /* block should be aligned */
-        if (!aligned(heap_bp))
-        {
-            dbg_printf("line %d: block not aligned\n", lineno);
-            error_found = 1;
-        }
+/*
+ * slab_malloc - get a free slot for size bytes from the first run
+ * that has free slots, or from a new run
+ * return NULL if failed
+ */
+static void *slab_malloc(size_t size)
+{
+    u_32 slab_index = (size - 1) / ALIGNMENT;
+    run_t *run = (run_t *)B2P(arena->heap_listp, RUN_LISTS[slab_index]);
+    int i = 0;
 
-        /* block should be in the heap */
-        if (!in_heap(heap_bp))
+#if MM_RECENT
+    /* the slot last freed, while it's warm */
+    char *bp = B2P(arena->heap_listp, RECENT_SLOTS[slab_index]);
+
+    if (bp != NULL)
+    {
+        int slot;
+
+        ++STATS.recent_hits;
+        RECENT_SLOTS[slab_index] = 0;
+        run = (run_t *)((size_t)bp & ~(size_t)(RUN_SIZE - 1));
+        slot = (bp - RUN_SLOT(run, 0)) / run->slot_size;
+        run->free_map[slot >> 5] &= ~(1u << (slot & 31));
+        /* the run is full, remove it from the list, wherever it is */
+        if (--run->nfree == 0)
         {
-            dbg_printf("line %d: block not in heap\n", lineno);
-            error_found = 1;
+            if (run->prev)
+                ((run_t *)B2P(arena->heap_listp, run->prev))->next = run->next;
+            else
+                RUN_LISTS[slab_index] = run->next;
+            if (run->next)
+                ((run_t *)B2P(arena->heap_listp, run->next))->prev = run->prev;
         }
-        heap_bp = NEXT_BLKP(heap_bp);
+        return bp;
     }
+#endif
+    if (run == NULL && (run = new_run((slab_index + 1) * ALIGNMENT)) == NULL)
+        return NULL;
 
-    /* finally check every lists */
-    for (int list_index = 0; list_index < LISTNUM; ++list_index)
+    /* find the first free slot */
+    while (!run->free_map[i])
+        ++i;
+    int slot = (i << 5) + __builtin_ctz(run->free_map[i]);
+    run->free_map[i] &= run->free_map[i] - 1;
+#if MM_RECENT
+    if (RECENT_SLOTS[slab_index] == P2B(arena->heap_listp, RUN_SLOT(run, slot)))
+        RECENT_SLOTS[slab_index] = 0;
+#endif
+
+    /* the run is full, remove it from the list */
+    if (--run->nfree == 0)
     {
-        void *free_bp = B2P(heap_listp, seg_lists[list_index]);
+        RUN_LISTS[slab_index] = run->next;
+        if (run->next)
+            ((run_t *)B2P(arena->heap_listp, run->next))->prev = 0;
+    }
+    return RUN_SLOT(run, slot);
+}
 
-        while (free_bp != NULL)
-        {
-            /* first check if theres uncoalesced blocks */
-            if (!GET_ALLOC(HDRP(PREV_BLKP(free_bp))) || !GET_ALLOC(HDRP(NEXT_BLKP(free_bp))))
-            {
-                dbg_printf("line %d: free block not coalesced\n", lineno);
-                error_found = 1;
-            }
+/*
+ * slab_free - give slot bp back to its run
+ * the run is added to the list again if it was full, and is freed
+ * as a normal block if all its slots are free and it's not the only
+ * run in the list
+ */
+static void slab_free(run_t *run, void *bp)
+{
+    u_32 slab_index = run->slot_size / ALIGNMENT - 1;
+    int slot = ((char *)bp - RUN_SLOT(run, 0)) / run->slot_size;
 
-            /* then check if the size fits */
-            size_t size = GET_SIZE(HDRP(free_bp));
-            if (!((size > (8 << list_index)) && (size <= (16 << list_index))))
-            {
-                dbg_printf("line %d: block in wrong list\n");
-                error_found = 1;
-            }
-            free_bp = B2P(heap_listp, NEXT_FBP_BIAS(free_bp));
-        }
+    run->free_map[slot >> 5] |= (1u << (slot & 31));
+#if MM_RECENT
+    RECENT_SLOTS[slab_index] = P2B(arena->heap_listp, bp);
+#endif
+
+    if (run->nfree++ == 0) /* was full, insert as the new first node */
+    {
+        run->prev = 0;
+        run->next = RUN_LISTS[slab_index];
+        if (run->next)
+            ((run_t *)B2P(arena->heap_listp, run->next))->prev = P2B(arena->heap_listp, run);
+        RUN_LISTS[slab_index] = P2B(arena->heap_listp, run);
+    }
+    else if ((run->nfree == RUN_SLOTS(run->slot_size)) && (run->prev || run->next))
+    {
+        /* the run is empty, remove it from the list and free it */
+        if (run->prev)
+            ((run_t *)B2P(arena->heap_listp, run->prev))->next = run->next;
+        else
+            RUN_LISTS[slab_index] = run->next;
+        if (run->next)
+            ((run_t *)B2P(arena->heap_listp, run->next))->prev = run->prev;
+#if MM_RECENT
+        RECENT_SLOTS[slab_index] = 0;
+#endif
+        mark_run(run, 0);
+        do_free(run);
     }
-    if (error_found)
-        exit(0);
 }
 
 /*
- * extend_heap - extend heap of at least size bytes
- * return pointer to block
+ * run_of - return the run that slot bp belongs to,
+ * or NULL if bp is not a slot
  */
-static void *extend_heap(size_t size)
+static inline run_t *run_of(const void *bp)
 {
-    char *bp;
-    size_t asize = ALIGN(size);
+#if MM_SLAB_MAX > 0
+    size_t page = PAGE_INDEX(bp);
+    u_32 *map;
 
-    /* extend the heap */
-    if ((long)(bp = mem_sbrk(asize)) == -1)
+    if (page >= __atomic_load_n(&RUN_MAP_BITS, __ATOMIC_ACQUIRE))
         return NULL;
+    map = (u_32 *)B2P(arena->heap_listp, RUN_MAP_BIAS);
+    if (!(map[page >> 5] & (1u << (page & 31))))
+        return NULL;
+    return (run_t *)((size_t)bp & ~(size_t)(RUN_SIZE - 1));
+#else
+    return NULL;
+#endif
+}
 
-    /* initialize free block header/footer and the epilogue header */
-
-    PUT(HDRP(bp), PACK(asize, 0));
-    PUT(FTRP(bp), PACK(asize, 0));
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
-    /* add the new block to the list */
-    add_to_list(bp, asize);
+/*
+ * run_start - compute where a run would start in free block bp,
+ * the block before the run should be large enough, or there's none
+ */
+static inline char *run_start(char *bp)
+{
+    char *run = (char *)RUN_ALIGN(bp);
 
-    /* coalesce if the previous block was free */
-    return coalesce(bp);
+    if ((run != bp) && (run - bp < 2 * DSIZE))
+        run += RUN_SIZE;
+    return run;
 }
 
 /*
- * coalesce - coalesce according to tag bit. 
- * Return ptr to coalesced block
+ * new_run - carve a new run for slot_size from a free block that
+ * contains a whole aligned run, or at the end of heap, from the last
+ * free block if there is one, and extend heap if needed
+ * return NULL if failed
  */
-static void *coalesce(void *bp)
+static run_t *new_run(size_t slot_size)
 {
-    short prev_alloc = GET_ALLOC(HDRP(PREV_BLKP(bp)));
-    short next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
-    size_t asize = GET_SIZE(HDRP(bp));
-    size_t next_size, prev_size;
+    char *brk;  /* the "block" of epilogue */
+    char *start = NULL;
+    char *bp = NULL;
+    size_t free_size, lead, tail;
+    u_32 prev_alloc;
+    run_t *run;
 
-    if (prev_alloc && next_alloc)
-        return bp;
-    else if (prev_alloc && !next_alloc) /* just coalesce the next block */
+    /* search the lists that may contain a run */
+    for (u_32 list_index = list_index_of(RUN_SIZE); list_index < LISTNUM && start == NULL; ++list_index)
     {
-        next_size = GET_SIZE(HDRP(NEXT_BLKP(bp)));
-
-        remove_from_list(bp, asize);
-        remove_from_list(NEXT_BLKP(bp), next_size);
-        asize += next_size;
-        PUT(HDRP(bp), PACK(asize, 0));
-        PUT(FTRP(bp), PACK(asize, 0));
+        if (!(SL_BITMAP(FL_OF(list_index)) & (1u << SL_OF(list_index))))
+            continue;
+        for (start = B2P(arena->heap_listp, arena->seg_lists[list_index]); start != NULL;
+             start = B2P(arena->heap_listp, NEXT_FBP_BIAS(start)))
+        {
+            bp = run_start(start);
+            if (bp + RUN_SIZE <= start + GET_SIZE(HDRP(start)))
+                break;
+        }
     }
-    else if (!prev_alloc && next_alloc) /* just coalesce the prev block */
+
+    /* no such block, carve it at the end of heap */
+    while (start == NULL)
     {
-        prev_size = GET_SIZE(HDRP(PREV_BLKP(bp)));
+        brk = arena->top;
+        start = GET_PREV_ALLOC(HDRP(brk)) ? brk : PREV_BLKP(brk);
+        bp = run_start(start);
+        if (bp + RUN_SIZE > brk)
+        {
+            /* try again after extending, the arena may grow in a new chunk */
+            if (extend_heap(MAX((size_t)(bp + RUN_SIZE - brk), 2 * DSIZE)) == NULL)
+                return NULL;
+            start = NULL;
+        }
+    }
 
-        remove_from_list(bp, asize);
-        remove_from_list(PREV_BLKP(bp), prev_size);
-        asize += prev_size;
-        bp = PREV_BLKP(bp);
-        PUT(HDRP(bp), PACK(asize, 0));
-        PUT(FTRP(bp), PACK(asize, 0));
+    /* now free block start contains the run, split it into three */
+    free_size = GET_SIZE(HDRP(start));
+    prev_alloc = GET_PREV_ALLOC(HDRP(start));
+    remove_from_list(start, free_size);
+    lead = bp - start;
+    tail = free_size - lead - RUN_SIZE;
+    if (tail < 2 * DSIZE) /* too small to split, just keep it in run */
+        tail = 0;
+
+    if (lead)
+    {
+        PUT(HDRP(start), PACK(lead, prev_alloc));
+        PUT(FTRP(start), PACK(lead, 0));
+        add_to_list(start, lead);
+        prev_alloc = 0;
     }
-    else /* coalesce both the prev and next block */
+    PUT(HDRP(bp), PACK(free_size - lead - tail, prev_alloc | 1));
+    if (tail)
     {
-        next_size = GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        prev_size = GET_SIZE(HDRP(PREV_BLKP(bp)));
-        remove_from_list(bp, asize);
-        remove_from_list(PREV_BLKP(bp), prev_size);
-        remove_from_list(NEXT_BLKP(bp), next_size);
-        asize += (next_size + prev_size);
-        bp = PREV_BLKP(bp);
-        PUT(HDRP(bp), PACK(asize, 0));
-        PUT(FTRP(bp), PACK(asize, 0));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(tail, PREV_ALLOC));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(tail, 0));
+        add_to_list(NEXT_BLKP(bp), tail);
     }
-    add_to_list(bp, asize);
-    return bp;
+    else
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+
+    /* initialize the run with all slots free */
+    run = (run_t *)bp;
+    run->slot_size = slot_size;
+    run->nfree = RUN_SLOTS(slot_size);
+    memset(run->free_map, 0, sizeof(run->free_map));
+    for (int i = 0; i < run->nfree; ++i)
+        run->free_map[i >> 5] |= (1u << (i & 31));
+
+    if (!mark_run(run, 1))
+    {
+        do_free(run);
+        return NULL;
+    }
+
+    /* insert as the only node of the list */
+    run->prev = 0;
+    run->next = 0;
+    RUN_LISTS[slot_size / ALIGNMENT - 1] = P2B(arena->heap_listp, run);
+    return run;
 }
 
-/* 
- * place - given free block pointer bp, allocate at least size bytes
- * split a new free block if block_size - size > 16
+/*
+ * mark_run - set or clear the bit of run in the page bitmap
+ * the bitmap is reallocated to be larger if the run is out of it
+ * return 0 if failed
  */
-static void *place(void *bp, size_t size)
+static int mark_run(run_t *run, int is_run)
 {
-    size_t blk_size = GET_SIZE(HDRP(bp));
-    size_t delta = blk_size - size;
-
-    remove_from_list(bp, blk_size);
+    size_t page = PAGE_INDEX(run);
+    u_32 *map = (u_32 *)B2P(arena->heap_listp, RUN_MAP_BIAS);
+    u_32 *new_map;
+    size_t map_size, new_size;
 
-    if (delta < (2 * DSIZE))
+    if (page >= RUN_MAP_BITS)
     {
-        PUT(HDRP(bp), PACK(blk_size, 1));
-        PUT(FTRP(bp), PACK(blk_size, 1));
+        if (!is_run)
+            return 1;
+        /* make the bitmap twice larger, at least larger than a slot */
+        map_size = RUN_MAP_BITS / 8;
+        new_size = MAX(MAX(2 * map_size, (page / 32 + 1) * sizeof(u_32)), MM_SLAB_MAX + DSIZE);
+        if ((new_map = alloc_block(ADJUST_SIZE(new_size))) == NULL)
+            return 0;
+        if (map != NULL)
+            memcpy(new_map, map, map_size);
+        memset((char *)new_map + map_size, 0, new_size - map_size);
+        /* publish the bias before the bits, run_of may run without the lock */
+        RUN_MAP_BIAS = P2B(arena->heap_listp, new_map);
+        __atomic_store_n(&RUN_MAP_BITS, new_size * 8, __ATOMIC_RELEASE);
+#ifdef MM_THREADS
+        /*
+         * run_of may read an old map without the lock at any time later, so
+         * none is freed till mm_init resets the heap. As each map is twice
+         * the one before, the old ones take less than the current one
+         */
+#else
+        if (map != NULL)
+            do_free(map);
+#endif
+        map = new_map;
     }
+
+    if (is_run)
+        map[page >> 5] |= (1u << (page & 31));
     else
-    {
-        PUT(HDRP(bp), PACK(size, 1));
-        PUT(FTRP(bp), PACK(size, 1));
-        add_to_list(NEXT_BLKP(bp), delta);
-        PUT(HDRP(NEXT_BLKP(bp)), PACK(delta, 0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(delta, 0));
-    }
-    return bp;
+        map[page >> 5] &= ~(1u << (page & 31));
+    return 1;
+}
+
+/*
+ * list_index_of - compute which list a block of size asize belongs to
+ * the first level is found by a bit scan, and the second level is
+ * the next MM_SL_LOG2 bits below the highest bit
+ */
+static inline u_32 list_index_of(size_t asize)
+{
+    u_32 log2 = 8 * sizeof(long) - 1 - __builtin_clzl(asize);
+    u_32 fl;
+
+    if (log2 < MM_SL_LOG2 + 3) /* small sizes, in steps of 8 */
+        return asize >> 3;
+
+    fl = log2 - (MM_SL_LOG2 + 3) + 1;
+    if (fl >= MM_FL_NUM) /* too large, all go to the last list */
+        return LISTNUM - 1;
+    return fl * SL_NUM + ((asize >> (log2 - MM_SL_LOG2)) & (SL_NUM - 1));
 }
 
 /* 
@@ -506,48 +2775,30 @@ static void *place(void *bp, size_t size)
  */
 static void add_to_list(void *bp, size_t asize)
 {
-    u_32 list_index = 0;
+    u_32 list_index = list_index_of(asize);
     void *next_ptr = NULL;
     void *prev_ptr = NULL;
 
-    while ((list_index < LISTNUM - 1) && (asize > (16 << list_index)))
-        ++list_index;
-
-    next_ptr = B2P(heap_listp, seg_lists[list_index]); /* initialize it as the first node */
+    next_ptr = B2P(arena->heap_listp, arena->seg_lists[list_index]); /* initialize it as the first node */
 
-    if (next_ptr == NULL) /* empty list, just insert */
+    /* walk to the place of the block, with LIFO it's the first node */
+    while ((next_ptr != NULL) && LIST_AFTER(next_ptr, bp, asize))
     {
-        SET_BIAS(PTR2NEXTBIAS(bp), 0);
-        SET_BIAS(PTR2PREVBIAS(bp), 0);
-        seg_lists[list_index] = P2B(heap_listp, bp);
+        prev_ptr = next_ptr;
+        next_ptr = B2P(arena->heap_listp, NEXT_FBP_BIAS(next_ptr));
     }
-    else if (asize <= GET_SIZE(HDRP(next_ptr))) /* not empty list, insert as the new first node */
-    {
-        SET_BIAS(PTR2NEXTBIAS(bp), P2B(heap_listp, next_ptr));
-        SET_BIAS(PTR2PREVBIAS(next_ptr), P2B(heap_listp, bp));
-        SET_BIAS(PTR2PREVBIAS(bp), 0);
-        seg_lists[list_index] = P2B(heap_listp, bp);
-    }
-    else /* not empty list and not the first node */
+
+    SET_BIAS(PTR2NEXTBIAS(bp), next_ptr ? P2B(arena->heap_listp, next_ptr) : 0);
+    SET_BIAS(PTR2PREVBIAS(bp), prev_ptr ? P2B(arena->heap_listp, prev_ptr) : 0);
+    if (next_ptr != NULL)
+        SET_BIAS(PTR2PREVBIAS(next_ptr), P2B(arena->heap_listp, bp));
+    if (prev_ptr != NULL)
+        SET_BIAS(PTR2NEXTBIAS(prev_ptr), P2B(arena->heap_listp, bp));
+    else /* the new first node */
     {
-        while ((next_ptr != NULL) && (asize > GET_SIZE(HDRP(next_ptr))))
-        {
-            prev_ptr = next_ptr;
-            next_ptr = B2P(heap_listp, NEXT_FBP_BIAS(next_ptr));
-        }
-        if (next_ptr != NULL) /* inset in the middle */
-        {
-            SET_BIAS(PTR2NEXTBIAS(bp), P2B(heap_listp, next_ptr));
-            SET_BIAS(PTR2PREVBIAS(next_ptr), P2B(heap_listp, bp));
-            SET_BIAS(PTR2NEXTBIAS(prev_ptr), P2B(heap_listp, bp));
-            SET_BIAS(PTR2PREVBIAS(bp), P2B(heap_listp, prev_ptr));
-        }
-        else /* insert as the last node */
-        {
-            SET_BIAS(PTR2NEXTBIAS(bp), 0);
-            SET_BIAS(PTR2NEXTBIAS(prev_ptr), P2B(heap_listp, bp));
-            SET_BIAS(PTR2PREVBIAS(bp), P2B(heap_listp, prev_ptr));
-        }
+        arena->seg_lists[list_index] = P2B(arena->heap_listp, bp);
+        SL_BITMAP(FL_OF(list_index)) |= (1u << SL_OF(list_index));
+        FL_BITMAP |= (1u << FL_OF(list_index));
     }
 }
 
@@ -556,28 +2807,269 @@ static void add_to_list(void *bp, size_t asize)
  */
 static void remove_from_list(void *bp, size_t asize)
 {
-    u_32 list_index = 0;
+    u_32 list_index = list_index_of(asize);
     void *next_ptr = NULL;
     void *prev_ptr = NULL;
 
-    while ((list_index < LISTNUM - 1) && (asize > (16 << list_index)))
-        ++list_index;
-
-    next_ptr = B2P(heap_listp, NEXT_FBP_BIAS(bp));
-    prev_ptr = B2P(heap_listp, PREV_FBP_BIAS(bp));
+    next_ptr = B2P(arena->heap_listp, NEXT_FBP_BIAS(bp));
+    prev_ptr = B2P(arena->heap_listp, PREV_FBP_BIAS(bp));
+#if MM_RECENT
+    if (RECENT_LISTS[FL_OF(list_index)] == P2B(arena->heap_listp, bp))
+        RECENT_LISTS[FL_OF(list_index)] = 0;
+#endif
 
     if ((prev_ptr == NULL) && (next_ptr == NULL)) /* remove the only node in the list */
-        seg_lists[list_index] = 0;
+    {
+        arena->seg_lists[list_index] = 0;
+        SL_BITMAP(FL_OF(list_index)) &= ~(1u << SL_OF(list_index));
+        if (!SL_BITMAP(FL_OF(list_index)))
+            FL_BITMAP &= ~(1u << FL_OF(list_index));
+    }
     else if ((prev_ptr == NULL) && (next_ptr != NULL)) /* remove the first node in the list */
     {
         SET_BIAS(PTR2PREVBIAS(next_ptr), 0);
-        seg_lists[list_index] = P2B(heap_listp, next_ptr);
+        arena->seg_lists[list_index] = P2B(arena->heap_listp, next_ptr);
     }
     else if ((prev_ptr != NULL) && (next_ptr == NULL)) /* remove the last node in the list */
         SET_BIAS(PTR2NEXTBIAS(prev_ptr), 0);
     else /* remove a middle node in the list */
     {
-        SET_BIAS(PTR2NEXTBIAS(prev_ptr), P2B(heap_listp, next_ptr));
-        SET_BIAS(PTR2PREVBIAS(next_ptr), P2B(heap_listp, prev_ptr));
+        SET_BIAS(PTR2NEXTBIAS(prev_ptr), P2B(arena->heap_listp, next_ptr));
+        SET_BIAS(PTR2PREVBIAS(next_ptr), P2B(arena->heap_listp, prev_ptr));
+    }
+}
+
+#ifdef MM_THREADS
+/*
+ * many_threads - return whether a second thread has called the allocator
+ * till then there are no thread caches, and no arenas by CPU: to a single
+ * thread they are only memory held out of the heap, which is 10 points of
+ * utilization on the traces
+ */
+static inline int many_threads(void)
+{
+    if (!thread_seen)
+    {
+        thread_seen = 1;
+        __atomic_fetch_add(&threads_seen, 1, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&threads_seen, __ATOMIC_RELAXED) > 1;
+}
+
+/*
+ * tcache_self - return the cache of this thread, emptied if it belongs
+ * to an old heap, and registered to be flushed at thread exit
+ */
+static tcache_t *tcache_self(void)
+{
+    tcache_t *tc = &tcache;
+
+    if (tc->gen != heap_gen)
+    {
+        memset(tc->bins, 0, sizeof(tc->bins));
+        memset(tc->counts, 0, sizeof(tc->counts));
+        tc->gen = heap_gen;
+    }
+    if (!tc->registered)
+    {
+        pthread_once(&tcache_once, tcache_key_init);
+        pthread_setspecific(tcache_key, tc);
+        tc->registered = 1;
+    }
+    return tc;
+}
+
+/*
+ * tcache_get - take a block for size bytes from the cache of this thread
+ * an empty bin is refilled with half of MM_TCACHE_COUNT blocks at once
+ * return NULL if the size is not cached or the heap is out of memory
+ */
+static void *tcache_get(size_t size)
+{
+    size_t index = (size + ALIGNMENT - 1) / ALIGNMENT;
+    tcache_t *tc;
+    arena_t *a;
+    void *bp;
+
+    if (size > MM_TCACHE_MAX || !many_threads())
+        return NULL;
+    if ((a = thread_arena()) == NULL)
+        return NULL;
+    tc = tcache_self();
+
+    if (tc->counts[index] == 0)
+    {
+        /* ALIGNMENT * index bytes, so that the block goes back to the same bin */
+        LOCK(a);
+        arena = a;
+        remote_drain();
+        for (int i = 0; i < MM_TCACHE_COUNT / 2; ++i)
+        {
+            if ((bp = do_malloc(index * ALIGNMENT)) == NULL)
+                break;
+            stat_alloc(bp);
+#ifdef DEBUG
+            check_touched(bp, __LINE__);
+#endif
+            TC_NEXT(bp) = tc->bins[index];
+            tc->bins[index] = bp;
+            ++tc->counts[index];
+        }
+#ifdef DEBUG
+        check_call(NULL, __LINE__);
+#endif
+        UNLOCK(a);
+        if (tc->counts[index] == 0)
+            return NULL;
+    }
+
+    bp = tc->bins[index];
+    tc->bins[index] = TC_NEXT(bp);
+    --tc->counts[index];
+    return bp;
+}
+
+/*
+ * tcache_put - keep the freed block bp in the cache of this thread
+ * a full bin is flushed to half first
+ * return 0 if the block is not cached
+ */
+static int tcache_put(void *bp)
+{
+    size_t usable, index;
+    run_t *run;
+    tcache_t *tc;
+
+    if (arenas[0] == NULL || !many_threads())
+        return 0;
+    /* only the prev-alloc bit of the header may change under us */
+    arena = arena_of(bp);
+    if ((run = run_of(bp)) != NULL)
+        usable = run->slot_size;
+    else
+        usable = (__atomic_load_n((word_t *)HDRP(bp), __ATOMIC_RELAXED) & ~0x7) - WSIZE;
+    if (usable > MM_TCACHE_MAX)
+        return 0;
+
+    tc = tcache_self();
+    index = usable / ALIGNMENT;
+    if (tc->counts[index] >= MM_TCACHE_COUNT)
+        tcache_flush(tc, index, MM_TCACHE_COUNT / 2);
+    TC_NEXT(bp) = tc->bins[index];
+    tc->bins[index] = bp;
+    ++tc->counts[index];
+    return 1;
+}
+
+/*
+ * tcache_flush - give blocks of bin index back to their arenas till keep
+ * left, blocks of this thread's arena are freed under one lock, and the
+ * others are pushed to the remote lists of their arenas
+ */
+static void tcache_flush(tcache_t *tc, size_t index, size_t keep)
+{
+    arena_t *mine = thread_arena();
+    arena_t *owner;
+    int locked = 0;
+    void *bp;
+#ifdef DEBUG
+    void *touched;
+#endif
+
+    while (tc->counts[index] > keep)
+    {
+        bp = tc->bins[index];
+        tc->bins[index] = TC_NEXT(bp);
+        --tc->counts[index];
+        if ((owner = arena_of(bp)) != mine)
+        {
+            remote_free(owner, bp);
+            continue;
+        }
+        if (!locked)
+        {
+            LOCK(mine);
+            arena = mine;
+            locked = 1;
+        }
+        stat_free(bp);
+#ifdef DEBUG
+        touched = check_freeing(bp);
+#endif
+        do_free(bp);
+#ifdef DEBUG
+        check_touched(touched, __LINE__);
+#endif
+    }
+    if (locked)
+    {
+#ifdef DEBUG
+        check_call(NULL, __LINE__);
+#endif
+        UNLOCK(mine);
+    }
+}
+
+/*
+ * tcache_exit - flush the whole cache of an exiting thread
+ */
+static void tcache_exit(void *arg)
+{
+    tcache_t *tc = arg;
+
+    if (tc->gen == heap_gen)
+        for (size_t i = 0; i < TCACHE_NUM; ++i)
+            tcache_flush(tc, i, 0);
+}
+
+/*
+ * tcache_key_init - create the key whose destructor flushes thread caches
+ */
+static void tcache_key_init(void)
+{
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/*
+ * remote_free - push block bp to the remote list of arena a
+ * many threads may push at the same time, with a CAS each
+ */
+static void remote_free(arena_t *a, void *bp)
+{
+    void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+
+    do
+        TC_NEXT(bp) = head;
+    while (!__atomic_compare_exchange_n(&a->remote, &head, bp, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * remote_drain - free all the blocks in the remote list of the current
+ * arena, whose lock must be held. The list is taken at once, so the
+ * pushers are never blocked
+ */
+static void remote_drain(void)
+{
+    void *bp, *next;
+#ifdef DEBUG
+    void *touched;
+#endif
+
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == NULL)
+        return;
+    bp = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+    for (; bp != NULL; bp = next)
+    {
+        next = TC_NEXT(bp);
+        stat_free(bp);
+#ifdef DEBUG
+        touched = check_freeing(bp);
+#endif
+        do_free(bp);
+#ifdef DEBUG
+        check_touched(touched, __LINE__);
+#endif
     }
 }
+#endif
@@ -7,6 +7,13 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_valloc(size_t size);
+extern void *mm_pvalloc(size_t size);
+extern void *mm_reallocarray(void *ptr, size_t nmemb, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
 
 #else
 
@@ -15,10 +22,55 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
+extern void *reallocarray(void *ptr, size_t nmemb, size_t size);
+extern size_t malloc_usable_size(void *ptr);
 
 #endif
 
 extern int mm_init(void);
 
+/*
+ * Allocate n blocks of size bytes to ptrs in one call, and return how
+ * many were allocated; free n blocks in one call, ptrs is not changed
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/*
+ * Counters of the allocator, read by mm_stats. Class i holds the blocks
+ * of [2^i, 2^(i+1)) bytes, headers included, and the last class all the
+ * larger ones. A block resized in place stays in the class it was
+ * allocated in.
+ */
+#define MM_STATS_CLASSES 40
+
+typedef struct {
+    size_t mallocs[MM_STATS_CLASSES];     /* blocks allocated in the heap */
+    size_t frees[MM_STATS_CLASSES];       /* blocks freed to the heap */
+    size_t free_blocks[MM_STATS_CLASSES]; /* blocks in the free lists now */
+    size_t maps;             /* huge blocks mapped, and unmapped */
+    size_t unmaps;
+    size_t splits;           /* free blocks split by an allocation or shrink */
+    size_t coalesces;        /* free blocks merged with a neighbour */
+    size_t extends;          /* calls of extend_heap */
+    size_t trims;            /* times the heap was given back */
+    size_t realloc_in_place; /* reallocs that kept the block */
+    size_t realloc_copies;   /* reallocs that moved it */
+    size_t recent_hits;      /* fits that took the block last freed to a list */
+    size_t in_use;           /* bytes of allocated blocks, mapped too */
+    size_t free_bytes;       /* bytes of free blocks, in lists or fastbins */
+    size_t heap_size;        /* bytes of the heap and the mapped regions */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
+
+/* Write the blocks of every arena to out as JSON */
+extern void mm_heap_snapshot(FILE *out);
+
 /* This is largely for debugging. */
 extern void mm_checkheap(int lineno);
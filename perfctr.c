@@ -0,0 +1,107 @@
+/****************************
+ * Hardware counter wrappers
+ ****************************/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "perfctr.h"
+
+/* short names for the columns of mdriver */
+const char *perf_names[PERF_NUM] = { "insn", "L1d", "LLC", "dTLB", "br", "pf" };
+
+static int fds[PERF_NUM] = { -1, -1, -1, -1, -1, -1 };
+
+#ifdef __linux__
+#define CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    unsigned type;
+    unsigned long long config;
+} events[PERF_NUM] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    { PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+    { PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+#endif
+
+/*
+ * perf_init - open the counters of user space for this thread, each on
+ *     its own so that a machine without one still has the others
+ *     return the number of counters opened
+ */
+int perf_init(void)
+{
+    int i, n = 0;
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    for (i = 0; i < PERF_NUM; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[i] >= 0)
+            n++;
+    }
+#else
+    for (i = 0; i < PERF_NUM; i++)
+        fds[i] = -1;
+#endif
+    return n;
+}
+
+/*
+ * perf_start - reset and start the counters
+ */
+void perf_start(void)
+{
+#ifdef __linux__
+    int i;
+
+    for (i = 0; i < PERF_NUM; i++) {
+        if (fds[i] < 0)
+            continue;
+        ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+/*
+ * perf_stop - stop the counters and read them since perf_start, scaled
+ *     up if the kernel had to share the hardware among them
+ *     a counter that is not available reads -1
+ */
+void perf_stop(double counts[PERF_NUM])
+{
+    int i;
+#ifdef __linux__
+    unsigned long long value[3]; /* count, time enabled, time running */
+
+    for (i = 0; i < PERF_NUM; i++)
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif
+    for (i = 0; i < PERF_NUM; i++) {
+        counts[i] = -1;
+#ifdef __linux__
+        if (fds[i] < 0 || read(fds[i], value, sizeof(value)) != sizeof(value))
+            continue;
+        counts[i] = value[2] ? (double)value[0] * value[1] / value[2] : (double)value[0];
+#endif
+    }
+}
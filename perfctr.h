@@ -0,0 +1,9 @@
+/* Hardware counters of the calling thread, from perf_event_open */
+
+#define PERF_NUM 6   /* instructions, L1d, LLC and dTLB misses, branch misses, page faults */
+
+extern const char *perf_names[PERF_NUM];
+
+int perf_init(void);
+void perf_start(void);
+void perf_stop(double counts[PERF_NUM]);